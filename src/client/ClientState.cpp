@@ -96,7 +96,8 @@ std::optional<Socket> ClientState::connect_server() {
 }
 
 bool ClientState::read_server_messages(std::optional<Duration> timeout) {
-  return m_server.read_messages(*this, timeout);
+  // wake up for accepting and reading controls
+  return m_server.read_messages(*this, timeout, m_control.socket());
 }
 
 void ClientState::on_server_disconnected() {
@@ -238,6 +239,10 @@ void ClientState::read_control_messages() {
   m_control.read_messages(*this);
 }
 
+void ClientState::on_configuration_requested_message() {
+  send_config();
+}
+
 void ClientState::on_next_key_info_message(const std::vector<Key>& keys, DeviceDesc device) {
   extern const char* current_system;
   auto ss = std::stringstream();
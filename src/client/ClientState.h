@@ -35,6 +35,7 @@ protected:
   void on_execute_action_message(int triggered_action) override;
   void on_virtual_key_state_message(Key key, KeyState state) override;
   void on_next_key_info_message(const std::vector<Key>& keys, DeviceDesc device) override;
+  void on_configuration_requested_message() override;
 
   // control messages
   void on_set_virtual_key_state_message(Key key, KeyState state) override;
@@ -5,34 +5,130 @@
 #include <algorithm>
 #include <utility>
 
+#if defined(__linux__)
+# include <sys/epoll.h>
+# include <unistd.h>
+#endif
+
+namespace {
+  // subscribers are not waited for, ones which do not keep up are dropped
+  const auto max_subscriber_queue_size = size_t{ 64 * 1024 };
+
+  void queue_virtual_key_state_changed(Connection& connection, 
+      Key key, KeyState state) {
+    connection.queue_message([&](Serializer& s) {
+      s.write(MessageType::virtual_key_state_changed);
+      s.write(key);
+      s.write(state);
+    });
+  }
+
+#if defined(__linux__)
+  bool add_to_epoll(int epoll_fd, Socket socket) {
+    auto event = epoll_event{ };
+    event.events = EPOLLIN;
+    event.data.fd = socket;
+    return (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &event) == 0);
+  }
+#endif
+} // namespace
+
 ControlPort::ControlPort() 
   : m_host("keymapperctl") {
 }
 
+ControlPort::~ControlPort() {
+  reset();
+}
+
 void ControlPort::reset() {
   m_host.shutdown();
   m_virtual_keys_down = { };
+  m_virtual_key_state_page.release_all_keys();
   m_virtual_key_aliases = { };
   m_controls.clear();
+  for (auto& waiters : m_virtual_key_waiters)
+    waiters.clear();
+  m_any_virtual_key_waiters.clear();
+  for (auto& subscribers : m_virtual_key_subscribers)
+    subscribers.clear();
+  m_all_virtual_key_subscribers.clear();
+
+#if defined(__linux__)
+  if (m_epoll_fd >= 0) {
+    ::close(m_epoll_fd);
+    m_epoll_fd = -1;
+  }
+#endif
 }
 
 std::optional<Socket> ControlPort::listen() {
-  if (m_host.listen())
+  if (m_host.listen()) {
+#if defined(__linux__)
+    if (m_epoll_fd < 0)
+      m_epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd < 0 || !add_to_epoll(m_epoll_fd, m_host.listen_socket())) {
+      error("Polling control port failed");
+      return { };
+    }
+    if (!m_virtual_key_state_page && !m_virtual_key_state_page.create())
+      verbose("Creating virtual key state page failed");
+#endif
     return m_host.listen_socket();
+  }
 
   error("Binding control port failed");
   return { };
 }
 
+Socket ControlPort::socket() const {
+#if defined(__linux__)
+  if (m_epoll_fd >= 0)
+    return m_epoll_fd;
+#endif
+  return m_host.listen_socket();
+}
+
 std::optional<Socket> ControlPort::accept() {
   if (auto connection = m_host.accept(std::chrono::seconds::zero())) {
     const auto socket = connection.socket();
-    m_controls.emplace(socket, Control{ std::move(connection) });
+    add_control(std::move(connection));
     return socket;
   }
   return { };
 }
 
+void ControlPort::add_control(Connection connection) {
+  const auto socket = connection.socket();
+#if defined(__linux__)
+  if (!add_to_epoll(m_epoll_fd, socket))
+    return;
+#endif
+  auto& control = m_controls.emplace(socket, 
+    Control{ std::move(connection) }).first->second;
+
+  // let keymapperctl read the virtual key states without a round-trip
+  control.connection.attach_file_descriptor(
+    m_virtual_key_state_page.read_only_fd());
+  control.connection.send_message([&](Serializer& s) {
+    s.write(MessageType::virtual_key_state_page);
+  });
+}
+
+auto ControlPort::remove_control(ControlMap::iterator it) -> ControlMap::iterator {
+  const auto socket = it->first;
+  remove_virtual_key_waiter(socket, 
+    it->second.requested_virtual_key_toggle_notification);
+  for (auto key : it->second.subscribed_virtual_keys)
+    if (auto subscribers = get_virtual_key_subscribers(key))
+      subscribers->erase(std::remove(subscribers->begin(), 
+        subscribers->end(), socket), subscribers->end());
+#if defined(__linux__)
+  ::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+#endif
+  return m_controls.erase(it);
+}
+
 void ControlPort::set_virtual_key_aliases(
     std::vector<std::pair<std::string, Key>> aliases) {
   m_virtual_key_aliases = std::move(aliases);
@@ -41,7 +137,9 @@ void ControlPort::set_virtual_key_aliases(
 void ControlPort::on_virtual_key_state_changed(Key key, KeyState state) {
   if (is_virtual_key(key)) {
     m_virtual_keys_down[get_virtual_key_index(key)] = (state == KeyState::Down);
+    m_virtual_key_state_page.set_key_down(key, state == KeyState::Down);
     send_virtual_key_toggle_notification(key);
+    send_virtual_key_state_changed(key, state);
 
     if (g_verbose_output) {
       const auto change = (state == KeyState::Down ? "pressed" : "released");
@@ -54,12 +152,102 @@ void ControlPort::on_virtual_key_state_changed(Key key, KeyState state) {
 }
 
 void ControlPort::send_virtual_key_toggle_notification(Key key) {
-  for (auto& [socket, control] : m_controls)
-    if (auto& requested_key = control.requested_virtual_key_toggle_notification;
-        requested_key == key || requested_key == Key::any) {
-      requested_key = Key::none;
-      send_virtual_key_state(control.connection, key);
+  // only visit the controls, which are waiting for the key
+  const auto notify_waiters = [&](std::vector<Socket>& waiters) {
+    m_notify_buffer.swap(waiters);
+    for (auto socket : m_notify_buffer)
+      if (auto it = m_controls.find(socket); it != m_controls.end()) {
+        it->second.requested_virtual_key_toggle_notification = Key::none;
+        send_virtual_key_state(it->second.connection, key);
+      }
+    m_notify_buffer.clear();
+  };
+  if (auto waiters = get_virtual_key_waiters(key))
+    notify_waiters(*waiters);
+  notify_waiters(m_any_virtual_key_waiters);
+}
+
+void ControlPort::send_virtual_key_state_changed(Key key, KeyState state) {
+  const auto notify_subscribers = [&](const std::vector<Socket>& subscribers) {
+    for (auto socket : subscribers)
+      if (auto it = m_controls.find(socket); it != m_controls.end()) {
+        auto& connection = it->second.connection;
+        queue_virtual_key_state_changed(connection, key, state);
+        if (!connection.flush(false) ||
+            connection.queued_size() > max_subscriber_queue_size)
+          m_notify_buffer.push_back(socket);
+      }
+  };
+  if (auto subscribers = get_virtual_key_subscribers(key))
+    notify_subscribers(*subscribers);
+  notify_subscribers(m_all_virtual_key_subscribers);
+
+  for (auto socket : m_notify_buffer)
+    if (auto it = m_controls.find(socket); it != m_controls.end())
+      remove_control(it);
+  m_notify_buffer.clear();
+}
+
+void ControlPort::on_virtual_key_states_subscribed(Connection& connection,
+    const std::vector<std::string>& names) {
+  auto control = get_control(connection);
+  if (!control)
+    return;
+
+  const auto subscribe = [&](Key key) {
+    auto& keys = control->subscribed_virtual_keys;
+    if (std::find(keys.begin(), keys.end(), key) != keys.end())
+      return;
+    if (auto subscribers = get_virtual_key_subscribers(key)) {
+      subscribers->push_back(connection.socket());
+      keys.push_back(key);
+    }
+  };
+  // reply with the current state of each key, or the pressed keys when
+  // subscribing to all
+  if (names.empty()) {
+    subscribe(Key::any);
+    for (auto i = 0; i < get_virtual_key_count(); ++i)
+      if (m_virtual_keys_down[static_cast<size_t>(i)])
+        queue_virtual_key_state_changed(connection, 
+          ::get_virtual_key(i), KeyState::Down);
+    return;
+  }
+  for (const auto& name : names) {
+    const auto key = get_virtual_key(name);
+    if (is_virtual_key(key)) {
+      subscribe(key);
+      queue_virtual_key_state_changed(connection, key, 
+        get_virtual_key_state(key));
     }
+    else {
+      queue_virtual_key_state_changed(connection, Key::none, KeyState::Not);
+    }
+  }
+}
+
+std::vector<Socket>* ControlPort::get_virtual_key_subscribers(Key key) {
+  if (key == Key::any)
+    return &m_all_virtual_key_subscribers;
+  if (is_virtual_key(key))
+    return &m_virtual_key_subscribers[
+      static_cast<size_t>(get_virtual_key_index(key))];
+  return nullptr;
+}
+
+std::vector<Socket>* ControlPort::get_virtual_key_waiters(Key key) {
+  if (key == Key::any)
+    return &m_any_virtual_key_waiters;
+  if (is_virtual_key(key))
+    return &m_virtual_key_waiters[
+      static_cast<size_t>(get_virtual_key_index(key))];
+  return nullptr;
+}
+
+void ControlPort::remove_virtual_key_waiter(Socket socket, Key key) {
+  if (auto waiters = get_virtual_key_waiters(key))
+    waiters->erase(std::remove(waiters->begin(), waiters->end(), socket),
+      waiters->end());
 }
 
 auto ControlPort::get_control(const Connection& connection) -> Control* {
@@ -95,14 +283,19 @@ KeyState ControlPort::get_virtual_key_state(Key key) const {
   return KeyState::Not;
 }
 
-bool ControlPort::send_virtual_key_state(Connection& connection, Key key, KeyState state) {
-  return connection.send_message([&](Serializer& s) {
+void ControlPort::queue_virtual_key_state(Connection& connection, Key key, KeyState state) {
+  connection.queue_message([&](Serializer& s) {
     s.write(MessageType::virtual_key_state);
     s.write(key);
     s.write(state);
   });
 }
 
+bool ControlPort::send_virtual_key_state(Connection& connection, Key key, KeyState state) {
+  queue_virtual_key_state(connection, key, state);
+  return connection.flush();
+}
+
 bool ControlPort::send_virtual_key_state(Connection& connection, Key key) {
   return send_virtual_key_state(connection, key, get_virtual_key_state(key));
 }
@@ -110,8 +303,15 @@ bool ControlPort::send_virtual_key_state(Connection& connection, Key key) {
 void ControlPort::on_virtual_key_toggle_notification_requested(
     Connection& connection, Key key) {
   if (key != Key::none) {
-    if (auto control = get_control(connection))
-      control->requested_virtual_key_toggle_notification = key;
+    if (auto control = get_control(connection)) {
+      auto& requested_key = control->requested_virtual_key_toggle_notification;
+      if (requested_key != key) {
+        remove_virtual_key_waiter(connection.socket(), requested_key);
+        if (auto waiters = get_virtual_key_waiters(key))
+          waiters->push_back(connection.socket());
+        requested_key = key;
+      }
+    }
   }
   else {
     send_virtual_key_state(connection, key);
@@ -132,7 +332,7 @@ void ControlPort::disconnect_by_instance_id(const std::string& id) {
 
   for (auto it = m_controls.begin(); it != m_controls.end(); ) {
     if (it->second.instance_id == id) {
-      it = m_controls.erase(it);
+      it = remove_control(it);
     }
     else {
       ++it;
@@ -140,10 +340,36 @@ void ControlPort::disconnect_by_instance_id(const std::string& id) {
   }
 }
 
+#if defined(__linux__)
+
+void ControlPort::read_messages(MessageHandler& handler) {
+  if (m_epoll_fd < 0)
+    return;
+
+  // only visit the controls, which are readable
+  epoll_event events[64];
+  auto count = static_cast<int>(std::size(events));
+  while (count == static_cast<int>(std::size(events))) {
+    count = ::epoll_wait(m_epoll_fd, events, std::size(events), 0);
+    for (auto i = 0; i < count; ++i) {
+      const auto socket = events[i].data.fd;
+      if (socket == m_host.listen_socket()) {
+        while (accept()) { }
+      }
+      else if (auto it = m_controls.find(socket); it != m_controls.end()) {
+        if (!read_messages(it->second.connection, handler))
+          remove_control(it);
+      }
+    }
+  }
+}
+
+#else // !defined(__linux__)
+
 void ControlPort::read_messages(MessageHandler& handler) {
   for (auto it = m_controls.begin(); it != m_controls.end(); ) {
     if (!read_messages(it->second.connection, handler)) {
-      it = m_controls.erase(it);
+      it = remove_control(it);
     }
     else {
       ++it;
@@ -151,6 +377,8 @@ void ControlPort::read_messages(MessageHandler& handler) {
   }
 }
 
+#endif // !defined(__linux__)
+
 void ControlPort::on_next_key_info_requested(Connection& connection) {
   if (auto control = get_control(connection))
     control->requested_next_key_info = true;
@@ -171,18 +399,18 @@ bool ControlPort::reply_next_key_info(const std::string& key_info) {
 
 bool ControlPort::read_messages(Connection& connection, 
     MessageHandler& handler) {
-  return connection.read_messages(Duration::zero(), 
+  // replies to pipelined requests are sent together
+  const auto queue_result =
+    [&](bool result, Key key = Key::none) {
+      queue_virtual_key_state(connection, key, 
+        result ? KeyState::Up : KeyState::Not);
+    };
+  const auto read = connection.read_messages(Duration::zero(), 
     [&](Deserializer& d) {
-      const auto send_result =
-        [&](bool result, Key key = Key::none) {
-          send_virtual_key_state(connection, key, 
-            result ? KeyState::Up : KeyState::Not);
-        };
-
       switch (d.read<MessageType>()) {
         case MessageType::get_virtual_key_state: {
-          send_virtual_key_state(connection, 
-            get_virtual_key(d.read_string()));
+          const auto key = get_virtual_key(d.read_string());
+          queue_virtual_key_state(connection, key, get_virtual_key_state(key));
           break;
         }
         case MessageType::set_key_state: {
@@ -190,16 +418,25 @@ bool ControlPort::read_messages(Connection& connection,
           const auto state = d.read<KeyState>();
           if (auto virtual_key = get_virtual_key(input); virtual_key != Key::none) {
             handler.on_set_virtual_key_state_message(virtual_key, state);
-            send_virtual_key_state(connection, virtual_key);
+            queue_virtual_key_state(connection, virtual_key, 
+              get_virtual_key_state(virtual_key));
           }
           else if (auto key = get_key_by_name(input); key != Key::none) {
-            send_result(handler.on_inject_output_message({ key, state }), key);
+            queue_result(handler.on_inject_output_message({ key, state }), key);
           }
           else {
-            send_result(false);
+            queue_result(false);
           }
           break;
         }
+        case MessageType::subscribe_virtual_key_states: {
+          auto names = std::vector<std::string>();
+          for (auto count = d.read<uint32_t>(); 
+               count > 0 && d.can_read(sizeof(uint32_t)); --count)
+            names.push_back(d.read_string());
+          on_virtual_key_states_subscribed(connection, names);
+          break;
+        }
         case MessageType::request_virtual_key_toggle_notification: {
           on_virtual_key_toggle_notification_requested(connection,
             get_virtual_key(d.read_string()));
@@ -207,11 +444,11 @@ bool ControlPort::read_messages(Connection& connection,
         }
         case MessageType::set_instance_id: {
           on_set_instance_id(connection, d.read_string());
-          send_result(true);
+          queue_result(true);
           break;
         }
         case MessageType::set_config_file: {
-          send_result(handler.on_set_config_file_message(d.read_string()));
+          queue_result(handler.on_set_config_file_message(d.read_string()));
           break;
         }
         case MessageType::next_key_info: {
@@ -220,19 +457,20 @@ bool ControlPort::read_messages(Connection& connection,
           break;
         }
         case MessageType::inject_input: {
-          send_result(handler.on_inject_input_message(d.read_string()));
+          queue_result(handler.on_inject_input_message(d.read_string()));
           break;
         }
         case MessageType::inject_output: {
-          send_result(handler.on_inject_output_message(d.read_string()));
+          queue_result(handler.on_inject_output_message(d.read_string()));
           break;
         }
         case MessageType::notify: {
-          send_result(handler.on_notify_message(d.read_string()));
+          queue_result(handler.on_notify_message(d.read_string()));
           break;
         }
         default: 
           break;
       }
     });
+  return (connection.flush() && read);
 }
@@ -3,18 +3,25 @@
 #include "runtime/KeyEvent.h"
 #include "common/MessageType.h"
 #include "common/Host.h"
+#include "common/VirtualKeyStatePage.h"
 #include <memory>
 #include <vector>
 #include <optional>
 #include <bitset>
-#include <map>
+#include <array>
+#include <unordered_map>
 
 class ControlPort {
 public:
   ControlPort();
+  ControlPort(const ControlPort&) = delete;
+  ControlPort& operator=(const ControlPort&) = delete;
+  ~ControlPort();
   void reset();
   std::optional<Socket> listen();
   std::optional<Socket> accept();
+  // readable when a control connects or sent a message
+  Socket socket() const;
   void set_virtual_key_aliases(std::vector<std::pair<std::string, Key>> aliases);
   void on_virtual_key_state_changed(Key key, KeyState state);
   bool reply_next_key_info(const std::string& key_info);
@@ -35,17 +42,29 @@ private:
     Connection connection;
     std::string instance_id;
     Key requested_virtual_key_toggle_notification{ };
+    std::vector<Key> subscribed_virtual_keys;
     bool requested_next_key_info{ };
   };
 
+  using ControlMap = std::unordered_map<Socket, Control>;
+
   Control* get_control(const Connection& connection);
+  void add_control(Connection connection);
+  ControlMap::iterator remove_control(ControlMap::iterator it);
+  std::vector<Socket>* get_virtual_key_waiters(Key key);
+  void remove_virtual_key_waiter(Socket socket, Key key);
+  std::vector<Socket>* get_virtual_key_subscribers(Key key);
   Key get_virtual_key(const std::string_view name) const;
   const std::string* get_virtual_key_alias(Key key) const;
   KeyState get_virtual_key_state(Key key) const;
   bool read_messages(Connection& connection, MessageHandler& handler);
   bool send_virtual_key_state(Connection& connection, Key key);
   bool send_virtual_key_state(Connection& connection, Key key, KeyState state);
+  void queue_virtual_key_state(Connection& connection, Key key, KeyState state);
   void send_virtual_key_toggle_notification(Key key);
+  void send_virtual_key_state_changed(Key key, KeyState state);
+  void on_virtual_key_states_subscribed(Connection& connection,
+    const std::vector<std::string>& names);
   void on_virtual_key_toggle_notification_requested(
     Connection& connection, Key key);
   void on_next_key_info_requested(Connection& connection);
@@ -54,6 +73,18 @@ private:
 
   Host m_host;
   std::bitset<get_virtual_key_count()> m_virtual_keys_down{ };
+  VirtualKeyStatePage m_virtual_key_state_page;
   std::vector<std::pair<std::string, Key>> m_virtual_key_aliases;
-  std::map<Socket, Control> m_controls;
+  ControlMap m_controls;
+  // sockets of controls waiting for a toggle notification, by virtual key
+  std::array<std::vector<Socket>, get_virtual_key_count()> m_virtual_key_waiters;
+  std::vector<Socket> m_any_virtual_key_waiters;
+  // sockets of controls subscribed to state changes, by virtual key
+  std::array<std::vector<Socket>, get_virtual_key_count()> m_virtual_key_subscribers;
+  std::vector<Socket> m_all_virtual_key_subscribers;
+  std::vector<Socket> m_notify_buffer;
+#if defined(__linux__)
+  // readiness of listen socket and controls is polled at once
+  int m_epoll_fd{ -1 };
+#endif
 };
@@ -1,6 +1,7 @@
 
 #include "ServerPort.h"
 #include "common/MessageType.h"
+#include <unordered_map>
 
 namespace {
   void write_key_sequence(Serializer& s, const KeySequence& sequence) {
@@ -14,45 +15,41 @@ namespace {
     s.write(filter.invert);
   }
 
-  void write_contexts(Serializer& s, 
-      const std::vector<Config::Context>& contexts) {
-    s.write(static_cast<uint32_t>(contexts.size()));
-    for (const auto& context : contexts) {
-      // begin stage
-      s.write(context.begin_stage);
-
-      // inputs
-      s.write(static_cast<uint32_t>(context.inputs.size()));
-      for (const auto& input : context.inputs) {
-        write_key_sequence(s, input.input);
-        s.write(static_cast<int32_t>(input.output_index));
-      }
+  void write_context(Serializer& s, const Config::Context& context) {
+    // begin stage
+    s.write(context.begin_stage);
 
-      // outputs
-      s.write(static_cast<uint32_t>(context.outputs.size()));
-      for (const auto& output : context.outputs)
-        write_key_sequence(s, output);
+    // inputs
+    s.write(static_cast<uint32_t>(context.inputs.size()));
+    for (const auto& input : context.inputs) {
+      write_key_sequence(s, input.input);
+      s.write(static_cast<int32_t>(input.output_index));
+    }
 
-      // command outputs
-      s.write(static_cast<uint32_t>(context.command_outputs.size()));
-      for (const auto& command : context.command_outputs) {
-        write_key_sequence(s, command.output);
-        s.write(static_cast<int32_t>(command.index));
-      }
+    // outputs
+    s.write(static_cast<uint32_t>(context.outputs.size()));
+    for (const auto& output : context.outputs)
+      write_key_sequence(s, output);
 
-      // device filter
-      write_filter(s, context.device_filter);
-      
-      // device-id filter
-      write_filter(s, context.device_id_filter);
-      
-      // modifier filter
-      write_key_sequence(s, context.modifier_filter);
-      s.write(context.invert_modifier_filter);
-
-      // fallthrough
-      s.write(context.fallthrough);
+    // command outputs
+    s.write(static_cast<uint32_t>(context.command_outputs.size()));
+    for (const auto& command : context.command_outputs) {
+      write_key_sequence(s, command.output);
+      s.write(static_cast<int32_t>(command.index));
     }
+
+    // device filter
+    write_filter(s, context.device_filter);
+    
+    // device-id filter
+    write_filter(s, context.device_id_filter);
+    
+    // modifier filter
+    write_key_sequence(s, context.modifier_filter);
+    s.write(context.invert_modifier_filter);
+
+    // fallthrough
+    s.write(context.fallthrough);
   }
 
   void write_grab_device_filters(Serializer& s, 
@@ -71,6 +68,13 @@ namespace {
       s.write(directive);
   }
 
+  template<typename F> // void(Serializer&)
+  std::string serialize(F&& write) {
+    auto s = Serializer();
+    write(s);
+    return std::string(s.data(), s.size());
+  }
+
   void write_active_contexts(Serializer& s, const std::vector<int>& indices) {
     s.write(static_cast<uint32_t>(indices.size()));
     for (const auto& index : indices)
@@ -83,21 +87,119 @@ ServerPort::ServerPort()
 }
 
 bool ServerPort::connect() {
-  m_connection = m_host.connect();
+  m_connection = m_host.connect(std::nullopt, true);
+  m_sent_configs.clear();
   return static_cast<bool>(m_connection);
 }
 
 void ServerPort::disconnect() {
   m_connection.disconnect();
+  m_sent_configs.clear();
 }
 
 bool ServerPort::send_config(const Config& config) {
-  return m_connection.send_message([&](Serializer& s) {
-    s.write(MessageType::configuration);
-    write_grab_device_filters(s, config.grab_device_filters);    
-    write_contexts(s, config.contexts);
+  auto parts = SerializedConfig{ };
+  parts.grab_device_filters = serialize([&](Serializer& s) {
+    write_grab_device_filters(s, config.grab_device_filters);
+  });
+  parts.contexts.reserve(config.contexts.size());
+  for (const auto& context : config.contexts)
+    parts.contexts.push_back(serialize([&](Serializer& s) {
+      write_context(s, context);
+    }));
+  parts.directives = serialize([&](Serializer& s) {
     write_directives(s, config.server_directives);
   });
+
+  auto image = Serializer();
+  image.write(parts.grab_device_filters.data(), parts.grab_device_filters.size());
+  image.write(static_cast<uint32_t>(parts.contexts.size()));
+  for (const auto& context : parts.contexts)
+    image.write(context.data(), context.size());
+  image.write(parts.directives.data(), parts.directives.size());
+
+  parts.hash = std::hash<std::string_view>()(
+    std::string_view(image.data(), image.size()));
+
+  // switching back to a recent configuration only needs its hash
+  auto current = m_sent_configs.front();
+  if (current && current->hash != parts.hash)
+    if (const auto cached = m_sent_configs.find(parts.hash)) {
+      // the hash is not unique, a different configuration replaces it
+      if (cached->grab_device_filters == parts.grab_device_filters &&
+          cached->contexts == parts.contexts &&
+          cached->directives == parts.directives) {
+        if (m_connection.send_message([&](Serializer& s) {
+              s.write(MessageType::configuration_cached);
+              s.write(parts.hash);
+            }))
+          return true;
+        m_sent_configs.clear();
+        return false;
+      }
+      // current is no longer at the front
+      current = nullptr;
+    }
+
+  // only send what changed since the last configuration, unless that is more
+  auto delta = std::optional<std::string>();
+  if (current) {
+    delta = serialize([&](Serializer& s) {
+      write_config_delta(s, config, parts, *current);
+    });
+    if (delta->size() >= image.size())
+      delta.reset();
+  }
+
+  const auto sent = (delta ? 
+    m_connection.send_message([&](Serializer& s) {
+      s.write(MessageType::configuration_delta);
+      s.write(parts.hash);
+      s.write(delta->data(), delta->size());
+    }) :
+    m_connection.send_message([&](Serializer& s) {
+      s.write(MessageType::configuration);
+      s.write(parts.hash);
+      s.write(image.data(), image.size());
+    }));
+
+  if (!sent) {
+    m_sent_configs.clear();
+    return false;
+  }
+  const auto hash = parts.hash;
+  m_sent_configs.insert(hash, std::move(parts));
+  return true;
+}
+
+void ServerPort::write_config_delta(Serializer& s, const Config& config, 
+    const SerializedConfig& parts, const SerializedConfig& sent) const {
+  auto sent_indices = std::unordered_map<std::string_view, int32_t>();
+  for (auto i = 0u; i < sent.contexts.size(); ++i)
+    sent_indices.emplace(sent.contexts[i], static_cast<int32_t>(i));
+
+  // reference unchanged contexts by their previous index
+  s.write(static_cast<uint32_t>(parts.contexts.size()));
+  for (auto i = 0u; i < parts.contexts.size(); ++i) {
+    const auto it = sent_indices.find(parts.contexts[i]);
+    if (it != sent_indices.end()) {
+      s.write(it->second);
+      s.write(config.contexts[i].begin_stage);
+    }
+    else {
+      s.write(int32_t{ -1 });
+      s.write(parts.contexts[i].data(), parts.contexts[i].size());
+    }
+  }
+
+  const auto write_if_changed = [&](const std::string& part,
+      const std::string& sent_part) {
+    s.write(part != sent_part);
+    if (part != sent_part)
+      s.write(part.data(), part.size());
+  };
+  write_if_changed(parts.grab_device_filters, sent.grab_device_filters);
+  write_if_changed(parts.directives, sent.directives);
 }
 
 bool ServerPort::send_active_contexts(const std::vector<int>& indices) {
@@ -142,7 +244,7 @@ bool ServerPort::send_inject_output(const KeySequence& sequence) {
 }
 
 bool ServerPort::read_messages(MessageHandler& handler,
-    std::optional<Duration> timeout) {
+    std::optional<Duration> timeout, Socket wake_socket) {
   return m_connection.read_messages(timeout,
     [&](Deserializer& d) {
       switch (d.read<MessageType>()) {
@@ -163,7 +265,13 @@ bool ServerPort::read_messages(MessageHandler& handler,
           handler.on_next_key_info_message(keys, std::move(device_desc));
           break;
         }
+        case MessageType::configuration_requested: {
+          // server no longer has any of the configurations
+          m_sent_configs.clear();
+          handler.on_configuration_requested_message();
+          break;
+        }
         default: break;
       }
-    });
+    }, wake_socket);
 }
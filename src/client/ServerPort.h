@@ -4,6 +4,7 @@
 #include "common/MessageType.h"
 #include "config/Config.h"
 #include "common/DeviceDesc.h"
+#include "common/LruCache.h"
 #include <memory>
 
 class ServerPort {
@@ -24,10 +25,26 @@ public:
     virtual void on_execute_action_message(int action_index) = 0;
     virtual void on_virtual_key_state_message(Key key, KeyState state) = 0;
     virtual void on_next_key_info_message(const std::vector<Key>& keys, DeviceDesc device) = 0;
+    virtual void on_configuration_requested_message() = 0;
   };
-  bool read_messages(MessageHandler& handler, std::optional<Duration> timeout);
+  bool read_messages(MessageHandler& handler, std::optional<Duration> timeout,
+    Socket wake_socket = invalid_socket);
 
 private:
+  // configuration parts, as they were serialized for the server
+  struct SerializedConfig {
+    uint64_t hash;
+    std::string grab_device_filters;
+    std::vector<std::string> contexts;
+    std::string directives;
+  };
+
+  void write_config_delta(Serializer& s, const Config& config,
+    const SerializedConfig& parts, const SerializedConfig& sent) const;
+
   Host m_host;
   Connection m_connection;
+  // configurations the server has cached, the current one at the front
+  LruCache<uint64_t, SerializedConfig> m_sent_configs{ 
+    configuration_cache_size };
 };
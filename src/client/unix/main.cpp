@@ -141,7 +141,10 @@ namespace {
       if (!g_state.read_server_messages(update_interval))
         return;
 
+#if !defined(__linux__)
+      // on Linux connections are accepted while reading control messages
       g_state.accept_control_connection();
+#endif
       g_state.read_control_messages();
       g_tray_icon.update();
     }
@@ -1,5 +1,8 @@
 
 #include "Connection.h"
+#include "SharedMemoryChannel.h"
+#include <algorithm>
+#include <limits>
 
 #if defined(_WIN32)
 
@@ -10,29 +13,117 @@
 #else // !defined(_WIN32)
 
 #include <utility>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 
 #endif // !defined(_WIN32)
 
+#if defined(__linux__)
+
+namespace {
+  const auto max_received_fds = size_t{ 4 };
+
+  // file descriptor is passed as ancillary data of the first byte
+  ssize_t send_socket(Socket socket_fd, const char* buffer,
+      size_t length, int fd, int flags) {
+    if (fd < 0)
+      return ::send(socket_fd, buffer, length, flags);
+
+    auto iov = iovec{ const_cast<char*>(buffer), length };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{ };
+    auto header = msghdr{ };
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    const auto cmsg = CMSG_FIRSTHDR(&header);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return ::sendmsg(socket_fd, &header, flags);
+  }
+
+  ssize_t recv_socket(Socket socket_fd, char* buffer, size_t length,
+      int flags, std::vector<int>& received_fds) {
+    auto iov = iovec{ buffer, length };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * max_received_fds)];
+    auto header = msghdr{ };
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    const auto result = ::recvmsg(socket_fd, &header, flags | MSG_CMSG_CLOEXEC);
+    if (result <= 0)
+      return result;
+
+    for (auto cmsg = CMSG_FIRSTHDR(&header); cmsg;
+         cmsg = CMSG_NXTHDR(&header, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      const auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (auto i = 0u; i < count; ++i) {
+        auto fd = -1;
+        std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        // do not let peer exhaust file descriptors
+        if (received_fds.size() < max_received_fds)
+          received_fds.push_back(fd);
+        else
+          ::close(fd);
+      }
+    }
+    return result;
+  }
+} // namespace
+
+#endif // defined(__linux__)
+
 timeval to_timeval(const Duration& duration) {
   using namespace std::chrono;
   if (duration < Duration::zero())
     return { };
-  const auto sec = duration_cast<seconds>(duration);
+  // round up, so a deadline is not missed by waking up too early
+  const auto usec = ceil<microseconds>(duration);
+  const auto sec = duration_cast<seconds>(usec);
   return {
     static_cast<decltype(timeval::tv_sec)>(sec.count()),
-    static_cast<decltype(timeval::tv_usec)>(
-      duration_cast<microseconds>(duration - sec).count())
+    static_cast<decltype(timeval::tv_usec)>((usec - sec).count())
   };
 }
 
-bool block_until_readable(Socket socket_fd, std::optional<Duration> timeout) {
+#if !defined(_WIN32)
+
+bool block_until_readable(Socket socket_fd, std::optional<Duration> timeout,
+    Socket wake_socket) {
+  // poll is not limited to descriptors below FD_SETSIZE
+  using namespace std::chrono;
+  auto timeout_ms = -1;
+  if (timeout)
+    timeout_ms = static_cast<int>(std::clamp<milliseconds::rep>(
+      ceil<milliseconds>(timeout.value()).count(), 
+      0, std::numeric_limits<int>::max()));
+  for (;;) {
+    // negative descriptors are ignored
+    pollfd pfds[2] = { { socket_fd, POLLIN, 0 }, { wake_socket, POLLIN, 0 } };
+    const auto result = ::poll(pfds, 2, timeout_ms);
+    if (result == -1 && errno == EINTR)
+      continue;
+    return (result >= 0);
+  }
+}
+
+#else // defined(_WIN32)
+
+bool block_until_readable(Socket socket_fd, std::optional<Duration> timeout,
+    Socket wake_socket) {
   auto read_set = fd_set{ };
   for (;;) {
     FD_ZERO(&read_set);
     FD_SET(socket_fd, &read_set);
+    if (wake_socket != invalid_socket)
+      FD_SET(wake_socket, &read_set);
     auto timeoutval = (timeout ? to_timeval(timeout.value()) : timeval{ });
     const auto result = ::select(static_cast<int>(socket_fd) + 1,
       &read_set, nullptr, nullptr, (timeout ? &timeoutval : nullptr));
@@ -42,21 +133,33 @@ bool block_until_readable(Socket socket_fd, std::optional<Duration> timeout) {
   }
 }
 
+#endif // defined(_WIN32)
+
+Connection::Connection() = default;
+
 Connection::Connection(Socket socket) 
   : m_socket_fd(socket) {
 }
 
 Connection::Connection(Connection&& rhs) noexcept
   : m_socket_fd(std::exchange(rhs.m_socket_fd, invalid_socket)),
+    m_channel(std::move(rhs.m_channel)),
+    m_send_fd(std::exchange(rhs.m_send_fd, -1)),
+    m_received_fds(std::move(rhs.m_received_fds)),
     m_serializer(std::move(rhs.m_serializer)),
-    m_deserializer(std::move(rhs.m_deserializer)) {
+    m_deserializer(std::move(rhs.m_deserializer)),
+    m_read_pos(std::exchange(rhs.m_read_pos, 0)) {
 }
 
 Connection& Connection::operator=(Connection&& rhs) noexcept {
   auto tmp = std::move(rhs);
   std::swap(m_socket_fd, tmp.m_socket_fd);
+  std::swap(m_channel, tmp.m_channel);
+  std::swap(m_send_fd, tmp.m_send_fd);
+  std::swap(m_received_fds, tmp.m_received_fds);
   std::swap(m_serializer, tmp.m_serializer);
   std::swap(m_deserializer, tmp.m_deserializer);
+  std::swap(m_read_pos, tmp.m_read_pos);
   return *this;
 }
 
@@ -69,24 +172,124 @@ void Connection::disconnect() {
     ::close(m_socket_fd);
     m_socket_fd = invalid_socket;
   }
+  m_channel.reset();
+  m_send_fd = -1;
+  close_received_file_descriptors();
   m_serializer.buffer.clear();
   m_deserializer.buffer.clear();
+  m_read_pos = 0;
 }
 
-bool Connection::wait_for_message(std::optional<Duration> timeout) {
-  return block_until_readable(m_socket_fd, timeout);
+bool Connection::flush(bool blocking) {
+  auto& buffer = m_serializer.buffer;
+  if (buffer.empty())
+    return true;
+
+  // file descriptors are only passed by blocking sends
+  if (blocking || m_send_fd >= 0) {
+    const auto result = send(buffer.data(), buffer.size());
+    buffer.clear();
+    return result;
+  }
+
+  auto sent = size_t{ };
+  const auto result = send_non_blocking(buffer.data(), buffer.size(), sent);
+  buffer.erase(buffer.begin(), 
+    buffer.begin() + static_cast<std::ptrdiff_t>(sent));
+  return result;
+}
+
+void Connection::discard_read_data() {
+  // only move unread data to front when it is at most as much as was read,
+  // so each byte is moved at most once on average
+  auto& buffer = m_deserializer.buffer;
+  if (m_read_pos == buffer.size()) {
+    buffer.clear();
+    m_read_pos = 0;
+  }
+  else if (m_read_pos >= buffer.size() - m_read_pos) {
+    buffer.erase(buffer.begin(), 
+      buffer.begin() + static_cast<std::ptrdiff_t>(m_read_pos));
+    m_read_pos = 0;
+  }
+}
+
+void Connection::attach_shared_memory(
+    std::unique_ptr<SharedMemoryChannel> channel) {
+  m_channel = std::move(channel);
+}
+
+int Connection::take_file_descriptor() {
+  if (m_received_fds.empty())
+    return -1;
+  const auto fd = m_received_fds.front();
+  m_received_fds.erase(m_received_fds.begin());
+  return fd;
+}
+
+void Connection::close_received_file_descriptors() {
+#if !defined(_WIN32)
+  for (auto fd : m_received_fds)
+    ::close(fd);
+#endif
+  m_received_fds.clear();
+}
+
+bool Connection::wait_for_message(std::optional<Duration> timeout,
+    Socket wake_socket) {
+  if (m_channel && m_channel->has_data())
+    return true;
+  return block_until_readable(m_socket_fd, timeout, wake_socket);
 }
 
 bool Connection::send(const char* buffer, size_t length) {
+  if (m_channel)
+    return send_shared_memory(buffer, length);
+
+  [[maybe_unused]] auto fd = std::exchange(m_send_fd, -1);
   while (length != 0) {
+#if defined(__linux__)
+    const auto result = send_socket(m_socket_fd, buffer, length, fd, 0);
+#else
     const auto result = ::send(m_socket_fd, buffer,
       static_cast<int>(length), 0);
+#endif
     if (result == -1 && (errno == EINTR || errno == EWOULDBLOCK))
       continue;
     if (result <= 0)
       return false;
     length -= static_cast<size_t>(result);
     buffer += result;
+    fd = -1;
+  }
+  return true;
+}
+
+bool Connection::send_non_blocking(const char* buffer, size_t length,
+    size_t& sent) {
+  sent = 0;
+  if (m_channel) {
+    const auto begin = buffer;
+    const auto result = write_shared_memory(buffer, length);
+    sent = static_cast<size_t>(buffer - begin);
+    return result;
+  }
+
+  while (sent < length) {
+    const auto result = ::send(m_socket_fd, buffer + sent,
+      static_cast<int>(length - sent), 0);
+#if defined(_WIN32)
+    if (result == -1 && WSAGetLastError() == WSAEWOULDBLOCK)
+      break;
+#else
+    if (result == -1 && errno == EINTR)
+      continue;
+    if (result == -1 && errno == EWOULDBLOCK)
+      break;
+#endif
+    if (result <= 0)
+      return false;
+    sent += static_cast<size_t>(result);
   }
   return true;
 }
@@ -94,8 +297,13 @@ bool Connection::send(const char* buffer, size_t length) {
 int Connection::recv(char* buffer, size_t length) {
   auto read = 0;
   while (length != 0) {
+#if defined(__linux__)
+    const auto result = recv_socket(m_socket_fd, buffer, length, 0,
+      m_received_fds);
+#else
     const auto result = ::recv(m_socket_fd, buffer,
       static_cast<int>(length), 0);
+#endif
 #if defined(_WIN32)
     if (result == -1 && WSAGetLastError() == WSAEWOULDBLOCK)
       break;
@@ -115,11 +323,15 @@ int Connection::recv(char* buffer, size_t length) {
 }
 
 bool Connection::recv(std::vector<char>& buffer) {
-  const auto buffer_grow_size = 1024;
+  if (m_channel)
+    return recv_shared_memory(buffer);
+
+  const auto buffer_grow_size = size_t{ 4096 };
   auto pos = buffer.size();
   for (;;) {
+    // use the already allocated capacity before growing
     if (pos == buffer.size())
-      buffer.resize(buffer.size() + buffer_grow_size);
+      buffer.resize(std::max(buffer.capacity(), pos + buffer_grow_size));
     const auto result = recv(buffer.data() + pos, buffer.size() - pos);
     if (result < 0)
       return false;
@@ -130,3 +342,79 @@ bool Connection::recv(std::vector<char>& buffer) {
   buffer.resize(pos);
   return true;
 }
+
+#if defined(__linux__)
+
+bool Connection::send_shared_memory(const char* buffer, size_t length) {
+  // file descriptor is sent ahead, so it is received before the data
+  if (const auto fd = std::exchange(m_send_fd, -1); fd >= 0)
+    for (;;) {
+      const auto byte = char{ };
+      const auto result = send_socket(m_socket_fd, &byte, 1, fd, MSG_NOSIGNAL);
+      if (result == 1)
+        break;
+      if (result == -1 && errno == EINTR)
+        continue;
+      if (result == -1 && errno == EWOULDBLOCK) {
+        auto pfd = pollfd{ m_socket_fd, POLLOUT, 0 };
+        ::poll(&pfd, 1, -1);
+        continue;
+      }
+      return false;
+    }
+
+  for (;;) {
+    if (!write_shared_memory(buffer, length))
+      return false;
+    if (length == 0)
+      return true;
+
+    // ring is full, wait for reader but stop when it hung up
+    const auto hang_up_check_interval_ms = 100;
+    m_channel->wait_until_writable(hang_up_check_interval_ms);
+    auto pfd = pollfd{ m_socket_fd, POLLRDHUP, 0 };
+    if (::poll(&pfd, 1, 0) > 0)
+      return false;
+  }
+}
+
+bool Connection::write_shared_memory(const char*& buffer, size_t& length) {
+  auto wake_reader = false;
+  if (!m_channel->write(buffer, length, wake_reader))
+    return false;
+
+  // only send a notification when the reader might be waiting,
+  // when the socket buffer is full, it has not caught up anyway
+  if (wake_reader) {
+    const auto byte = char{ };
+    const auto result = ::send(m_socket_fd, &byte, 1,
+      MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (result == -1 && errno != EINTR && errno != EWOULDBLOCK)
+      return false;
+  }
+  return true;
+}
+
+bool Connection::recv_shared_memory(std::vector<char>& buffer) {
+  // discard notifications before reading, so none gets lost
+  char notifications[256];
+  for (;;) {
+    const auto result = recv_socket(m_socket_fd, notifications,
+      sizeof(notifications), MSG_DONTWAIT, m_received_fds);
+    if (result == -1 && errno == EINTR)
+      continue;
+    if (result == -1 && errno == EWOULDBLOCK)
+      break;
+    if (result <= 0)
+      return false;
+  }
+  return m_channel->read(buffer);
+}
+
+#else // !defined(__linux__)
+
+bool Connection::send_shared_memory(const char*, size_t) { return false; }
+bool Connection::write_shared_memory(const char*&, size_t&) { return false; }
+bool Connection::recv_shared_memory(std::vector<char>&) { return false; }
+
+#endif // !defined(__linux__)
@@ -2,10 +2,12 @@
 
 #include <cstdint>
 #include <cstring>
+#include <memory>
 #include <string>
 #include <vector>
 #include <optional>
 #include <type_traits>
+#include <utility>
 #include "Duration.h"
 
 #if defined(_WIN32)
@@ -16,7 +18,11 @@ using Socket = int;
 
 constexpr Socket invalid_socket = ~Socket{ };
 
-bool block_until_readable(Socket socket, std::optional<Duration> timeout);
+class SharedMemoryChannel;
+
+// also returns when the optional wake socket becomes readable
+bool block_until_readable(Socket socket, std::optional<Duration> timeout,
+  Socket wake_socket = invalid_socket);
 
 class Serializer {
 public:
@@ -42,6 +48,9 @@ public:
     write(value.data(), sizeof(T) * value.size());
   }
 
+  const char* data() const { return buffer.data(); }
+  size_t size() const { return buffer.size(); }
+
 private:
   friend class Connection;
   std::vector<char> buffer;
@@ -51,7 +60,7 @@ class Deserializer {
 public:
   void read(void* data, size_t size) {
     if (size && can_read(size)) {
-      std::memcpy(data, &*it, size);
+      std::memcpy(data, it, size);
       it += size;
     }
   }
@@ -70,33 +79,39 @@ public:
 
   std::string read_string() {
     const auto size = read<uint32_t>();
-    auto result = std::string(size, ' ');
-    read(result.data(), size);
+    if (!can_read(size))
+      return { };
+    auto result = std::string(it, size);
+    it += size;
     return result;
   }
 
   template<typename T, typename = std::enable_if_t<std::is_trivially_copyable_v<T>>>
   std::vector<T> read_vector() {
     auto result = std::vector<T>{ };
-    result.resize(read<uint32_t>());
+    const auto size = read<uint32_t>();
+    if (!can_read(sizeof(T) * size))
+      return result;
+    result.resize(size);
     read(result.data(), sizeof(T) * result.size());
     return result;
   }
 
   bool can_read(size_t length) const { 
-    return (it - buffer.begin() + length <= buffer.size()); 
+    return (length <= static_cast<size_t>(end - it));
   }
 
 private:
   friend class Connection;
   std::vector<char> buffer;
-  std::vector<char>::iterator it;
+  const char* it{ };
+  const char* end{ };
 };
 
 class Connection {
   using Size = uint32_t;
 public:
-  Connection() = default;
+  Connection();
   explicit Connection(Socket socket);
   Connection(Connection&& rhs) noexcept;
   Connection& operator=(Connection&& rhs) noexcept;
@@ -106,6 +121,18 @@ public:
   explicit operator bool() const { return m_socket_fd != invalid_socket; }
   void disconnect();
 
+  // the socket then only carries wake-up notifications
+  void attach_shared_memory(std::unique_ptr<SharedMemoryChannel> channel);
+  bool has_shared_memory() const { return static_cast<bool>(m_channel); }
+
+  // file descriptor is passed along with the next data sent,
+  // it still needs to be closed by the caller afterwards
+  void attach_file_descriptor(int fd) { m_send_fd = fd; }
+
+  // returns the oldest received file descriptor or -1,
+  // the caller becomes its owner
+  int take_file_descriptor();
+
   template<typename T>
   bool send(const T& value) {
     return send(reinterpret_cast<const char*>(&value), sizeof(T));
@@ -118,22 +145,34 @@ public:
 
   template<typename F> // void(Serializer&)
   bool send_message(F&& write_message) {
-    // serialize messages to buffer
+    queue_message(std::forward<F>(write_message));
+    return flush();
+  }
+
+  // serializes message after the ones not yet sent
+  template<typename F> // void(Serializer&)
+  void queue_message(F&& write_message) {
     auto& buffer = m_serializer.buffer;
-    buffer.clear();
+    const auto offset = buffer.size();
+    m_serializer.write(Size{ });
     write_message(m_serializer);
 
-    // send message size and buffer
-    auto size = static_cast<Size>(buffer.size());
-    return send(reinterpret_cast<char*>(&size), sizeof(size)) &&
-           send(buffer.data(), buffer.size());
+    // patch size in front of message
+    const auto size = static_cast<Size>(buffer.size() - offset - sizeof(Size));
+    std::memcpy(buffer.data() + offset, &size, sizeof(Size));
   }
 
+  // sends all queued messages at once, when not blocking what could
+  // not be sent yet stays queued
+  bool flush(bool blocking = true);
+  size_t queued_size() const { return m_serializer.buffer.size(); }
+
   template<typename F> // void(Deserializer&)
-  bool read_messages(std::optional<Duration> timeout, F&& deserialize) {
-    // block until message can be read or timeout
+  bool read_messages(std::optional<Duration> timeout, F&& deserialize,
+      Socket wake_socket = invalid_socket) {
+    // block until message can be read, wake socket is readable or timeout
     if (timeout != Duration::zero() &&
-        !wait_for_message(timeout))
+        !wait_for_message(timeout, wake_socket))
       return false;
 
     // read into buffer until it would block
@@ -142,7 +181,8 @@ public:
       return false;
 
     // deserialize complete messages
-    m_deserializer.it = buffer.begin();
+    m_deserializer.it = buffer.data() + m_read_pos;
+    m_deserializer.end = buffer.data() + buffer.size();
     while (m_deserializer.can_read(sizeof(Size))) {
       const auto size = m_deserializer.read<Size>();
       if (!m_deserializer.can_read(size)) {
@@ -154,17 +194,29 @@ public:
       if (m_deserializer.it != end)
         return false;
     }
-    buffer.erase(buffer.begin(), m_deserializer.it);
+    m_read_pos = static_cast<size_t>(m_deserializer.it - buffer.data());
+    discard_read_data();
     return true;
   }
 
 private:
-  bool wait_for_message(std::optional<Duration> timeout);
+  bool wait_for_message(std::optional<Duration> timeout, Socket wake_socket);
   bool send(const char* buffer, size_t length);
+  bool send_non_blocking(const char* buffer, size_t length, size_t& sent);
   int recv(char* buffer, size_t length);
   bool recv(std::vector<char>& buffer);
 
+  bool send_shared_memory(const char* buffer, size_t length);
+  bool write_shared_memory(const char*& buffer, size_t& length);
+  bool recv_shared_memory(std::vector<char>& buffer);
+  void close_received_file_descriptors();
+  void discard_read_data();
+
   Socket m_socket_fd{ invalid_socket };
+  std::unique_ptr<SharedMemoryChannel> m_channel;
+  int m_send_fd{ -1 };
+  std::vector<int> m_received_fds;
   Serializer m_serializer;
   Deserializer m_deserializer;
+  size_t m_read_pos{ };
 };
@@ -1,5 +1,6 @@
 
 #include "Host.h"
+#include "SharedMemoryChannel.h"
 #include <thread>
 
 inline size_t get_version_hash() {
@@ -123,6 +124,60 @@ void make_non_blocking(Socket socket_fd) {
 
 #endif // !defined(_WIN32)
 
+#if defined(__linux__)
+
+namespace {
+  // client offers a shared memory channel by passing its file descriptor
+  bool accept_shared_memory(Connection& connection) {
+    auto offer = false;
+    if (!connection.read(&offer))
+      return false;
+    const auto memory_fd = connection.take_file_descriptor();
+
+    // fall back to socket when mapping fails
+    auto channel = std::unique_ptr<SharedMemoryChannel>();
+    if (memory_fd >= 0) {
+      if (offer) {
+        channel = std::make_unique<SharedMemoryChannel>();
+        if (!channel->map(memory_fd, false))
+          channel.reset();
+      }
+      ::close(memory_fd);
+    }
+    if (!connection.send(static_cast<bool>(channel)))
+      return false;
+    if (channel)
+      connection.attach_shared_memory(std::move(channel));
+    return true;
+  }
+
+  bool offer_shared_memory(Connection& connection) {
+    auto channel = std::unique_ptr<SharedMemoryChannel>();
+    auto memory_fd = SharedMemoryChannel::create_memory();
+    if (memory_fd >= 0) {
+      channel = std::make_unique<SharedMemoryChannel>();
+      if (!channel->map(memory_fd, true)) {
+        channel.reset();
+        ::close(memory_fd);
+        memory_fd = -1;
+      }
+    }
+    connection.attach_file_descriptor(memory_fd);
+    const auto sent = connection.send(memory_fd >= 0);
+    if (memory_fd >= 0)
+      ::close(memory_fd);
+
+    auto accepted = false;
+    if (!sent || !connection.read(&accepted))
+      return false;
+    if (accepted && channel)
+      connection.attach_shared_memory(std::move(channel));
+    return true;
+  }
+} // namespace
+
+#endif // defined(__linux__)
+
 Host::~Host() {
   shutdown();
 }
@@ -146,7 +201,7 @@ bool Host::listen() {
   ::chmod(addr.sun_path, 0666);
 #endif
 
-  if (::listen(m_listen_fd, 0) != 0)
+  if (::listen(m_listen_fd, SOMAXCONN) != 0)
     return false;
 
   make_non_blocking(m_listen_fd);
@@ -162,7 +217,8 @@ void Host::shutdown() {
   }
 }
 
-Connection Host::accept(std::optional<Duration> timeout) {
+Connection Host::accept(std::optional<Duration> timeout,
+    [[maybe_unused]] bool accept_shared_memory) {
   m_version_mismatch = false;
   if (!block_until_readable(m_listen_fd, timeout))
     return { };
@@ -189,11 +245,17 @@ Connection Host::accept(std::optional<Duration> timeout) {
     return { };
   }
 
+#if defined(__linux__)
+  if (accept_shared_memory && !::accept_shared_memory(connection))
+    return { };
+#endif
+
   make_non_blocking(socket_fd);
   return connection;
 }
 
-Connection Host::connect(std::optional<Duration> timeout) {
+Connection Host::connect(std::optional<Duration> timeout,
+    [[maybe_unused]] bool offer_shared_memory) {
   auto addr = sockaddr_un{ };
   addr.sun_family = AF_UNIX;
   set_unix_domain_socket_path(m_ipc_id, addr, false);
@@ -212,8 +274,13 @@ Connection Host::connect(std::optional<Duration> timeout) {
       
       // send version and read message which is sent after accept
       auto versions_match = false;
-      if (!connection.send(get_version_hash()) ||
-          !connection.read(&versions_match)) {
+      auto failed = (!connection.send(get_version_hash()) ||
+                     !connection.read(&versions_match));
+#if defined(__linux__)
+      if (!failed && versions_match && offer_shared_memory)
+        failed = !::offer_shared_memory(connection);
+#endif
+      if (failed) {
         // this fails regularly when reconnecting to a closing host
         connection.disconnect();
         socket_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
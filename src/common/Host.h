@@ -12,8 +12,12 @@ public:
 
   bool listen();
   void shutdown();
-  Connection accept(std::optional<Duration> timeout = std::nullopt);
-  Connection connect(std::optional<Duration> timeout = std::nullopt);
+  // shared memory is used for the connection when both sides enable it,
+  // otherwise the handshake is skipped
+  Connection accept(std::optional<Duration> timeout = std::nullopt,
+    bool accept_shared_memory = false);
+  Connection connect(std::optional<Duration> timeout = std::nullopt,
+    bool offer_shared_memory = false);
   bool version_mismatch() const { return m_version_mismatch; }
 
 private:
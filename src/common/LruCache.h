@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+// few values, the most recently used is at the front
+template<typename Key, typename Value>
+class LruCache {
+public:
+  explicit LruCache(size_t capacity) : m_capacity(capacity) { }
+
+  // inserts or replaces value, evicts the least recently used
+  Value& insert(const Key& key, Value value) {
+    erase(key);
+    if (m_entries.size() >= m_capacity)
+      m_entries.pop_back();
+    m_entries.insert(m_entries.begin(), { key, std::move(value) });
+    return m_entries.front().value;
+  }
+
+  // returns value and marks it as most recently used
+  Value* find(const Key& key) {
+    const auto it = std::find_if(m_entries.begin(), m_entries.end(),
+      [&](const Entry& entry) { return entry.key == key; });
+    if (it == m_entries.end())
+      return nullptr;
+    std::rotate(m_entries.begin(), it, std::next(it));
+    return &m_entries.front().value;
+  }
+
+  Value* front() {
+    return (m_entries.empty() ? nullptr : &m_entries.front().value);
+  }
+
+  void erase(const Key& key) {
+    m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(),
+      [&](const Entry& entry) { return entry.key == key; }), m_entries.end());
+  }
+
+  void clear() {
+    m_entries.clear();
+  }
+
+  size_t size() const {
+    return m_entries.size();
+  }
+
+private:
+  struct Entry {
+    Key key;
+    Value value;
+  };
+  size_t m_capacity;
+  std::vector<Entry> m_entries;
+};
@@ -18,4 +18,13 @@ enum class MessageType : uint8_t {
   inject_output,
   set_key_state,
   notify,
+  configuration_delta,
+  configuration_cached,
+  configuration_requested,
+  virtual_key_state_page,
+  subscribe_virtual_key_states,
+  virtual_key_state_changed,
 };
+
+// number of recent configurations the server keeps per connection
+const auto configuration_cache_size = 4;
@@ -0,0 +1,171 @@
+
+#include "SharedMemoryChannel.h"
+
+#if defined(__linux__)
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+struct SharedMemoryChannel::Ring {
+  // positions are not wrapped, the difference is the number of unread bytes
+  alignas(64) std::atomic<uint32_t> write_pos;
+  alignas(64) std::atomic<uint32_t> read_pos;
+  // set while the writer waits on the read position
+  std::atomic<uint32_t> writer_waiting;
+  alignas(64) char data[ring_size];
+};
+
+namespace {
+  static_assert((SharedMemoryChannel::ring_size & (SharedMemoryChannel::ring_size - 1)) == 0,
+    "ring size must be a power of two");
+
+  constexpr auto required_seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+  // the memory is shared between processes, so no private futex operations
+  uint32_t* futex_address(std::atomic<uint32_t>& value) {
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+    return reinterpret_cast<uint32_t*>(&value);
+  }
+
+  void futex_wait(std::atomic<uint32_t>& value, uint32_t expected, int timeout_ms) {
+    auto timeout = timespec{ timeout_ms / 1000, (timeout_ms % 1000) * 1000000l };
+    ::syscall(SYS_futex, futex_address(value), FUTEX_WAIT, expected,
+      &timeout, nullptr, 0);
+  }
+
+  void futex_wake(std::atomic<uint32_t>& value) {
+    ::syscall(SYS_futex, futex_address(value), FUTEX_WAKE, 1,
+      nullptr, nullptr, 0);
+  }
+} // namespace
+
+int SharedMemoryChannel::create_memory() {
+  const auto fd = ::memfd_create("keymapper", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
+
+  // peer must not be able to truncate the memory while it is mapped
+  if (::ftruncate(fd, 2 * sizeof(Ring)) != 0 ||
+      ::fcntl(fd, F_ADD_SEALS, required_seals) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+SharedMemoryChannel::~SharedMemoryChannel() {
+  if (m_memory)
+    ::munmap(m_memory, m_memory_size);
+}
+
+bool SharedMemoryChannel::map(int memory_fd, bool is_creator) {
+  struct stat st{ };
+  const auto seals = ::fcntl(memory_fd, F_GET_SEALS);
+  if (seals < 0 || (seals & required_seals) != required_seals ||
+      ::fstat(memory_fd, &st) != 0 ||
+      st.st_size != static_cast<off_t>(2 * sizeof(Ring)))
+    return false;
+
+  const auto memory = ::mmap(nullptr, 2 * sizeof(Ring),
+    PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+  if (memory == MAP_FAILED)
+    return false;
+
+  m_memory = memory;
+  m_memory_size = 2 * sizeof(Ring);
+  const auto rings = static_cast<Ring*>(memory);
+  m_send = &rings[is_creator ? 0 : 1];
+  m_receive = &rings[is_creator ? 1 : 0];
+  return true;
+}
+
+bool SharedMemoryChannel::write(const char*& data, size_t& size, bool& wake_reader) {
+  auto& ring = *m_send;
+  const auto write_pos = ring.write_pos.load(std::memory_order_relaxed);
+  const auto used = write_pos - ring.read_pos.load(std::memory_order_acquire);
+  if (used > ring_size)
+    return false;
+
+  const auto length = static_cast<uint32_t>(
+    std::min(size, static_cast<size_t>(ring_size - used)));
+  const auto offset = (write_pos & (ring_size - 1));
+  const auto first = std::min(length, ring_size - offset);
+  std::memcpy(ring.data + offset, data, first);
+  std::memcpy(ring.data, data + first, length - first);
+  data += length;
+  size -= length;
+
+  ring.write_pos.store(write_pos + length, std::memory_order_release);
+
+  // the reader might be waiting when it had read everything before,
+  // it checks the write position again after updating the read position
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  wake_reader = (length &&
+    ring.read_pos.load(std::memory_order_relaxed) == write_pos);
+  return true;
+}
+
+void SharedMemoryChannel::wait_until_writable(int timeout_ms) {
+  auto& ring = *m_send;
+  const auto read_pos = ring.read_pos.load(std::memory_order_acquire);
+  if (ring.write_pos.load(std::memory_order_relaxed) - read_pos < ring_size)
+    return;
+
+  // the reader checks the flag after updating the read position,
+  // the wait returns immediately when it was updated in between
+  ring.writer_waiting.store(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  futex_wait(ring.read_pos, read_pos, timeout_ms);
+  ring.writer_waiting.store(0, std::memory_order_relaxed);
+}
+
+bool SharedMemoryChannel::read(std::vector<char>& buffer) {
+  auto& ring = *m_receive;
+  auto read_pos = ring.read_pos.load(std::memory_order_relaxed);
+  for (auto progressed = false; ; progressed = true) {
+    const auto write_pos = ring.write_pos.load(std::memory_order_acquire);
+    const auto length = write_pos - read_pos;
+    if (length == 0) {
+      if (progressed && ring.writer_waiting.load(std::memory_order_relaxed))
+        futex_wake(ring.read_pos);
+      return true;
+    }
+    if (length > ring_size)
+      return false;
+
+    const auto offset = (read_pos & (ring_size - 1));
+    const auto first = std::min(length, ring_size - offset);
+    buffer.insert(buffer.end(), ring.data + offset, ring.data + offset + first);
+    buffer.insert(buffer.end(), ring.data, ring.data + (length - first));
+    read_pos = write_pos;
+
+    ring.read_pos.store(read_pos, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
+
+bool SharedMemoryChannel::has_data() const {
+  return (m_receive->write_pos.load(std::memory_order_acquire) !=
+          m_receive->read_pos.load(std::memory_order_relaxed));
+}
+
+#else // !defined(__linux__)
+
+struct SharedMemoryChannel::Ring { };
+int SharedMemoryChannel::create_memory() { return -1; }
+SharedMemoryChannel::~SharedMemoryChannel() = default;
+bool SharedMemoryChannel::map(int, bool) { return false; }
+bool SharedMemoryChannel::write(const char*&, size_t&, bool&) { return false; }
+void SharedMemoryChannel::wait_until_writable(int) { }
+bool SharedMemoryChannel::read(std::vector<char>&) { return false; }
+bool SharedMemoryChannel::has_data() const { return false; }
+
+#endif // !defined(__linux__)
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// pair of single producer/single consumer byte rings in shared memory,
+// which can replace the socket as transport of a Connection
+class SharedMemoryChannel {
+public:
+  static constexpr uint32_t ring_size = 64 * 1024;
+
+  // creates the shared memory of a new channel, returns -1 on failure
+  static int create_memory();
+
+  SharedMemoryChannel() = default;
+  SharedMemoryChannel(const SharedMemoryChannel&) = delete;
+  SharedMemoryChannel& operator=(const SharedMemoryChannel&) = delete;
+  ~SharedMemoryChannel();
+
+  // the creator of the memory sends with the first ring, the peer with the second
+  bool map(int memory_fd, bool is_creator);
+
+  // writes as much as fits, wake_reader is set when the reader might be waiting.
+  // returns false when the ring was corrupted by the peer
+  bool write(const char*& data, size_t& size, bool& wake_reader);
+
+  // blocks until the reader freed space in the full ring or the timeout elapsed
+  void wait_until_writable(int timeout_ms);
+
+  // appends all available bytes, returns false when the ring was corrupted
+  bool read(std::vector<char>& buffer);
+
+  bool has_data() const;
+
+private:
+  struct Ring;
+
+  void* m_memory{ };
+  size_t m_memory_size{ };
+  Ring* m_send{ };
+  Ring* m_receive{ };
+};
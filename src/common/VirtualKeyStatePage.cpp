@@ -0,0 +1,156 @@
+
+#include "VirtualKeyStatePage.h"
+
+#if defined(__linux__)
+
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+struct VirtualKeyStatePage::Page {
+  std::atomic<uint32_t> update_count;
+  std::atomic<uint32_t> key_change_counts[get_virtual_key_count()];
+};
+
+namespace {
+  static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+    sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+    "counters must be usable as futex words");
+
+  constexpr auto required_seals = F_SEAL_SHRINK | F_SEAL_GROW | 
+    F_SEAL_FUTURE_WRITE | F_SEAL_SEAL;
+
+  // not private, since the words are shared between processes
+  void futex_wait(const std::atomic<uint32_t>& word, uint32_t value,
+      Duration timeout) {
+    using namespace std::chrono;
+    const auto ns = duration_cast<nanoseconds>(std::max(timeout, Duration::zero()));
+    const auto sec = duration_cast<seconds>(ns);
+    const auto timeoutspec = timespec{
+      static_cast<decltype(timespec::tv_sec)>(sec.count()),
+      static_cast<decltype(timespec::tv_nsec)>((ns - sec).count())
+    };
+    ::syscall(SYS_futex, &word, FUTEX_WAIT, value, &timeoutspec, nullptr, 0);
+  }
+
+  void futex_wake_all(const std::atomic<uint32_t>& word) {
+    ::syscall(SYS_futex, &word, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+  }
+} // namespace
+
+VirtualKeyStatePage::~VirtualKeyStatePage() {
+  if (m_page)
+    ::munmap(m_page, sizeof(Page));
+  if (m_read_only_fd >= 0)
+    ::close(m_read_only_fd);
+}
+
+bool VirtualKeyStatePage::create() {
+  const auto fd = ::memfd_create("keymapper-keys", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return false;
+
+  auto memory = MAP_FAILED;
+  if (::ftruncate(fd, sizeof(Page)) == 0)
+    memory = ::mmap(nullptr, sizeof(Page), PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+
+  // only the existing mapping stays writable, readers cannot map the
+  // page writable, not even by reopening the descriptor
+  if (memory != MAP_FAILED &&
+      ::fcntl(fd, F_ADD_SEALS, required_seals) != 0) {
+    ::munmap(memory, sizeof(Page));
+    memory = MAP_FAILED;
+  }
+  if (memory == MAP_FAILED) {
+    ::close(fd);
+    return false;
+  }
+
+  m_page = static_cast<Page*>(memory);
+  m_read_only_fd = fd;
+  return true;
+}
+
+bool VirtualKeyStatePage::map(int memory_fd) {
+  struct stat st{ };
+  const auto seals = ::fcntl(memory_fd, F_GET_SEALS);
+  const auto memory = (seals >= 0 && 
+      (seals & required_seals) == required_seals &&
+      ::fstat(memory_fd, &st) == 0 &&
+      st.st_size == static_cast<off_t>(sizeof(Page)) ?
+    ::mmap(nullptr, sizeof(Page), PROT_READ, MAP_SHARED, memory_fd, 0) :
+    MAP_FAILED);
+  ::close(memory_fd);
+  if (memory == MAP_FAILED)
+    return false;
+
+  m_page = static_cast<Page*>(memory);
+  return true;
+}
+
+void VirtualKeyStatePage::set_key_down(Key key, bool down) {
+  if (!m_page || !is_virtual_key(key))
+    return;
+
+  auto& count = m_page->key_change_counts[get_virtual_key_index(key)];
+  const auto value = count.load(std::memory_order_relaxed);
+  if (((value & 1) != 0) == down)
+    return;
+
+  count.store(value + 1, std::memory_order_release);
+  futex_wake_all(count);
+  m_page->update_count.fetch_add(1, std::memory_order_release);
+  futex_wake_all(m_page->update_count);
+}
+
+void VirtualKeyStatePage::release_all_keys() {
+  for (auto i = 0; i < get_virtual_key_count(); ++i)
+    if (is_key_down(get_virtual_key(i)))
+      set_key_down(get_virtual_key(i), false);
+}
+
+bool VirtualKeyStatePage::is_key_down(Key key) const {
+  return (is_virtual_key(key) && (get_change_count(key) & 1) != 0);
+}
+
+uint32_t VirtualKeyStatePage::get_change_count(Key key) const {
+  if (!m_page)
+    return 0;
+  if (key == Key::any)
+    return m_page->update_count.load(std::memory_order_acquire);
+  if (is_virtual_key(key))
+    return m_page->key_change_counts[get_virtual_key_index(key)].load(
+      std::memory_order_acquire);
+  return 0;
+}
+
+void VirtualKeyStatePage::wait_for_change(Key key, uint32_t count,
+    Duration timeout) const {
+  if (!m_page)
+    return;
+  if (key == Key::any)
+    futex_wait(m_page->update_count, count, timeout);
+  else if (is_virtual_key(key))
+    futex_wait(m_page->key_change_counts[get_virtual_key_index(key)],
+      count, timeout);
+}
+
+#else // !defined(__linux__)
+
+struct VirtualKeyStatePage::Page { };
+VirtualKeyStatePage::~VirtualKeyStatePage() = default;
+bool VirtualKeyStatePage::create() { return false; }
+bool VirtualKeyStatePage::map(int) { return false; }
+void VirtualKeyStatePage::set_key_down(Key, bool) { }
+void VirtualKeyStatePage::release_all_keys() { }
+bool VirtualKeyStatePage::is_key_down(Key) const { return false; }
+uint32_t VirtualKeyStatePage::get_change_count(Key) const { return 0; }
+void VirtualKeyStatePage::wait_for_change(Key, uint32_t, Duration) const { }
+
+#endif // !defined(__linux__)
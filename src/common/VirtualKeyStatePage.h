@@ -0,0 +1,41 @@
+#pragma once
+
+#include "runtime/Key.h"
+#include "Duration.h"
+#include <cstdint>
+
+// states of the virtual keys, which keymapper publishes in shared memory,
+// so keymapperctl can query and wait for them without a round-trip
+class VirtualKeyStatePage {
+public:
+  VirtualKeyStatePage() = default;
+  VirtualKeyStatePage(const VirtualKeyStatePage&) = delete;
+  VirtualKeyStatePage& operator=(const VirtualKeyStatePage&) = delete;
+  ~VirtualKeyStatePage();
+
+  // creates the page for writing, read_only_fd() can be passed to readers,
+  // which cannot map it writable
+  bool create();
+  int read_only_fd() const { return m_read_only_fd; }
+
+  // maps a page for reading, takes ownership of the descriptor
+  bool map(int memory_fd);
+  explicit operator bool() const { return (m_page != nullptr); }
+
+  void set_key_down(Key key, bool down);
+  void release_all_keys();
+
+  // each change of a key's state increments its counter, an odd count
+  // means the key is down. the counter of Key::any counts all changes
+  bool is_key_down(Key key) const;
+  uint32_t get_change_count(Key key) const;
+
+  // blocks until the counter differs from count or the timeout elapsed
+  void wait_for_change(Key key, uint32_t count, Duration timeout) const;
+
+private:
+  struct Page;
+
+  Page* m_page{ };
+  int m_read_only_fd{ -1 };
+};
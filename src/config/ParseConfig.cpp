@@ -509,6 +509,16 @@ void ParseConfig::parse_directive(It it, const It end) {
     if (read_optional_bool())
       m_config.server_directives.push_back(ident);
   }
+  else if (ident == "linux-key-repeat") {
+    // delay in milliseconds and rate in repeats per second
+    auto delay = try_read_number(&it, end).value_or(250);
+    skip_space(&it, end);
+    auto rate = try_read_number(&it, end).value_or(30);
+    if (delay <= 0 || delay > 10000 || rate <= 0 || rate > 1000)
+      error("Invalid key repeat");
+    m_config.server_directives.push_back(ident + " " +
+      std::to_string(delay) + " " + std::to_string(rate));
+  }
   else if (ident == "virtual-keys-toggle") {
     // the current default is true
     if (read_optional_bool() == false)
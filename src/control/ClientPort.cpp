@@ -1,5 +1,16 @@
 
 #include "ClientPort.h"
+#include "config/get_key_name.h"
+#include <algorithm>
+
+#if defined(__linux__)
+# include <poll.h>
+#endif
+
+namespace {
+  // how often waiting on the shared memory checks if keymapper is still alive
+  const auto peer_closed_check_interval = std::chrono::milliseconds(100);
+} // namespace
 
 ClientPort::ClientPort() 
   : m_host("keymapperctl") {
@@ -7,7 +18,31 @@ ClientPort::ClientPort()
 
 bool ClientPort::connect(std::optional<Duration> timeout) {
   m_connection = m_host.connect(timeout);
-  return static_cast<bool>(m_connection);
+  m_virtual_key_state_page.reset();
+  m_virtual_key_states.clear();
+  if (!m_connection)
+    return false;
+  return read_virtual_key_state_page(timeout);
+}
+
+bool ClientPort::read_virtual_key_state_page(std::optional<Duration> timeout) {
+  // keymapper sends it first, the descriptor is missing when not supported
+  auto received = false;
+  while (!received)
+    if (!m_connection.read_messages(timeout,
+          [&](Deserializer& d) {
+            if (d.read<MessageType>() != MessageType::virtual_key_state_page)
+              return;
+            received = true;
+            const auto memory_fd = m_connection.take_file_descriptor();
+            if (memory_fd < 0)
+              return;
+            auto page = std::make_unique<VirtualKeyStatePage>();
+            if (page->map(memory_fd))
+              m_virtual_key_state_page = std::move(page);
+          }))
+      return false;
+  return true;
 }
 
 bool ClientPort::send_get_virtual_key_state(std::string_view name) {
@@ -86,15 +121,48 @@ bool ClientPort::send_notify(const std::string& string) {
   });
 }
 
+bool ClientPort::send_subscribe_virtual_key_states(
+    const std::vector<std::string>& names) {
+  return m_connection.send_message([&](Serializer& s) {
+    s.write(MessageType::subscribe_virtual_key_states);
+    s.write(static_cast<uint32_t>(names.size()));
+    for (const auto& name : names)
+      s.write(name);
+  });
+}
+
 bool ClientPort::read_virtual_key_state(std::optional<Duration> timeout, 
     std::optional<KeyState>* result) {
+  if (m_virtual_key_states.empty() &&
+      !m_connection.read_messages(timeout,
+        [&](Deserializer& d) {
+          switch (d.read<MessageType>()) {
+            case MessageType::virtual_key_state: {
+              d.read<Key>();
+              m_virtual_key_states.push_back(d.read<KeyState>());
+              break;
+            }
+            default: 
+              break;
+          }
+        }))
+    return false;
+
+  if (!m_virtual_key_states.empty()) {
+    result->emplace(m_virtual_key_states.front());
+    m_virtual_key_states.pop_front();
+  }
+  return true;
+}
+
+bool ClientPort::read_next_key_info(std::optional<Duration> timeout, 
+    std::string* result) {
   return m_connection.read_messages(timeout,
     [&](Deserializer& d) {
       switch (d.read<MessageType>()) {
-        case MessageType::virtual_key_state: {
-          d.read<Key>();
-          const auto state = d.read<KeyState>();
-          result->emplace(state);
+        case MessageType::next_key_info: {
+          if (result)
+            *result = d.read_string();
           break;
         }
         default: 
@@ -103,14 +171,15 @@ bool ClientPort::read_virtual_key_state(std::optional<Duration> timeout,
     });
 }
 
-bool ClientPort::read_next_key_info(std::optional<Duration> timeout, 
-    std::string* result) {
+bool ClientPort::read_virtual_key_state_changes(std::optional<Duration> timeout, 
+    std::vector<std::pair<Key, KeyState>>* changes) {
   return m_connection.read_messages(timeout,
     [&](Deserializer& d) {
       switch (d.read<MessageType>()) {
-        case MessageType::next_key_info: {
-          if (result)
-            *result = d.read_string();
+        case MessageType::virtual_key_state_changed: {
+          const auto key = d.read<Key>();
+          const auto state = d.read<KeyState>();
+          changes->emplace_back(key, state);
           break;
         }
         default: 
@@ -118,3 +187,57 @@ bool ClientPort::read_next_key_info(std::optional<Duration> timeout,
       }
     });
 }
+
+Key ClientPort::get_mapped_virtual_key(std::string_view name) const {
+  // aliases are only known by keymapper
+  const auto key = get_key_by_name(name);
+  if (!m_virtual_key_state_page ||
+      !(is_virtual_key(key) || key == Key::any))
+    return Key::none;
+  return key;
+}
+
+KeyState ClientPort::get_mapped_virtual_key_state(Key key) const {
+  if (!m_virtual_key_state_page || !is_virtual_key(key))
+    return KeyState::Not;
+  return (m_virtual_key_state_page->is_key_down(key) ?
+    KeyState::Down : KeyState::Up);
+}
+
+bool ClientPort::wait_mapped_virtual_key_state(Key key, 
+    std::optional<KeyState> state, std::optional<Duration> timeout,
+    std::optional<KeyState>* result) {
+  auto& page = *m_virtual_key_state_page;
+  if (!is_virtual_key(key))
+    state.reset();
+  const auto deadline = (timeout ? 
+    std::make_optional(Clock::now() + timeout.value()) : std::nullopt);
+  const auto initial_count = page.get_change_count(key);
+  for (;;) {
+    const auto count = page.get_change_count(key);
+    if (state ? get_mapped_virtual_key_state(key) == state :
+                count != initial_count) {
+      result->emplace(get_mapped_virtual_key_state(key));
+      return true;
+    }
+
+    auto interval = Duration(peer_closed_check_interval);
+    if (deadline) {
+      interval = std::min(interval, Duration(deadline.value() - Clock::now()));
+      if (interval <= Duration::zero())
+        return true;
+    }
+    page.wait_for_change(key, count, interval);
+    if (peer_closed())
+      return false;
+  }
+}
+
+bool ClientPort::peer_closed() const {
+#if defined(__linux__)
+  auto pfd = pollfd{ m_connection.socket(), POLLRDHUP, 0 };
+  return (::poll(&pfd, 1, 0) > 0);
+#else
+  return false;
+#endif
+}
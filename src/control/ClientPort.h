@@ -3,7 +3,10 @@
 #include "runtime/KeyEvent.h"
 #include "common/Host.h"
 #include "common/MessageType.h"
+#include "common/VirtualKeyStatePage.h"
 #include <memory>
+#include <deque>
+#include <vector>
 
 class ClientPort {
 public:
@@ -19,12 +22,29 @@ public:
   bool send_inject_output(const std::string& string);
   bool send_type_string(const std::string& string);
   bool send_notify(const std::string& string);
+  bool send_subscribe_virtual_key_states(const std::vector<std::string>& names);
   bool read_virtual_key_state(std::optional<Duration> timeout, 
     std::optional<KeyState>* result);
   bool read_next_key_info(std::optional<Duration> timeout, 
     std::string* result);
+  bool read_virtual_key_state_changes(std::optional<Duration> timeout, 
+    std::vector<std::pair<Key, KeyState>>* changes);
+
+  // virtual key states are read from shared memory, when keymapper
+  // passed it. returns Key::none when the state has to be requested
+  Key get_mapped_virtual_key(std::string_view name) const;
+  KeyState get_mapped_virtual_key_state(Key key) const;
+  // waits until the key has the state or, when none is passed, changed
+  bool wait_mapped_virtual_key_state(Key key, std::optional<KeyState> state,
+    std::optional<Duration> timeout, std::optional<KeyState>* result);
 
 private:
+  bool read_virtual_key_state_page(std::optional<Duration> timeout);
+  bool peer_closed() const;
+
   Host m_host;
   Connection m_connection;
+  std::unique_ptr<VirtualKeyStatePage> m_virtual_key_state_page;
+  // replies to pipelined requests, which were received together
+  std::deque<KeyState> m_virtual_key_states;
 };
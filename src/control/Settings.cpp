@@ -2,6 +2,8 @@
 #include "Settings.h"
 #include "common/output.h"
 #include <optional>
+#include <vector>
+#include <cctype>
 #include <cstdlib>
 
 template<typename T>
@@ -119,6 +121,17 @@ bool interpret_commandline(Settings& settings, int argc, char* argv[]) {
     else if (argument == T("--type-stdin")) {
       settings.requests.push_back({ RequestType::type_stdin, "", timeout });
     }
+    else if (argument == T("--monitor")) {
+      settings.requests.push_back({ RequestType::monitor,
+        read_sequence(), timeout });
+    }
+    else if (argument == T("--batch")) {
+      auto filename = std::string();
+      if (i + 1 < argc && *argv[i + 1] != '-')
+        filename = to_utf8(argv[++i]);
+      settings.requests.push_back({ RequestType::batch, 
+        std::move(filename), timeout });
+    }
     else {
       const auto request_type = [&]() -> std::optional<RequestType> {
         if (argument == T("--press")) return RequestType::press;
@@ -146,6 +159,56 @@ bool interpret_commandline(Settings& settings, int argc, char* argv[]) {
   return true;
 }
 
+bool interpret_batch_line(Settings& settings, std::string_view line) {
+  // split at whitespace, double quotes group, \" and \\ are escaped
+  auto arguments = std::vector<std::string>();
+  auto argument = std::string();
+  auto in_argument = false;
+  auto quoted = false;
+  for (auto i = size_t{ }; i < line.size(); ++i) {
+    const auto c = line[i];
+    if (!quoted && std::isspace(static_cast<unsigned char>(c))) {
+      if (in_argument)
+        arguments.push_back(std::move(argument));
+      argument.clear();
+      in_argument = false;
+      continue;
+    }
+    if (!quoted && !in_argument && c == '#')
+      break;
+
+    in_argument = true;
+    if (c == '"')
+      quoted = !quoted;
+    else if (c == '\\' && i + 1 < line.size() &&
+             (line[i + 1] == '"' || line[i + 1] == '\\'))
+      argument.push_back(line[++i]);
+    else
+      argument.push_back(c);
+  }
+  if (quoted)
+    return false;
+  if (in_argument)
+    arguments.push_back(std::move(argument));
+  if (arguments.empty())
+    return true;
+
+#if defined(_WIN32)
+  auto wide_arguments = std::vector<std::wstring>();
+  for (const auto& argument : arguments)
+    wide_arguments.push_back(utf8_to_wide(argument));
+  auto argv = std::vector<wchar_t*>{ nullptr };
+  for (auto& argument : wide_arguments)
+    argv.push_back(argument.data());
+#else
+  auto argv = std::vector<char*>{ nullptr };
+  for (auto& argument : arguments)
+    argv.push_back(argument.data());
+#endif
+  return interpret_commandline(settings, 
+    static_cast<int>(argv.size()), argv.data());
+}
+
 void print_help_message() {
   message(R"(
 keymapperctl %s
@@ -166,12 +229,14 @@ Usage: keymapperctl [--operation]
   --wait-pressed <key>  waits until a virtual key is pressed.
   --wait-released <key> waits until a virtual key is released.
   --wait-toggled <key>  waits until a virtual key is toggled (can also be Any).
+  --monitor [keys]      outputs each change of the virtual keys' states.
   --timeout <millisecs> sets a timeout for the following operation.
   --wait <millisecs>    unconditionally waits a given amount of time.
   --instance <id>       replaces another keymapperctl process with the same id.
   --print "string"      outputs the string to the console.
   --result              outputs the result code to the console (0 is success).
   --restart             starts processing the first operation again.
+  --batch [file]        reads operations line by line from file or stdin.
   -h, --help            print this help.
 
 %s
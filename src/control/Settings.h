@@ -26,6 +26,8 @@ enum class RequestType {
   type_string,
   type_stdin,
   notify,
+  batch,
+  monitor,
 };
 
 struct Request {
@@ -43,4 +45,6 @@ bool interpret_commandline(Settings& settings, int argc, wchar_t* argv[]);
 #else
 bool interpret_commandline(Settings& settings, int argc, char* argv[]);
 #endif
+// interprets a line of a batch, which contains arguments like the command line
+bool interpret_batch_line(Settings& settings, std::string_view line);
 void print_help_message();
@@ -1,9 +1,19 @@
 
 #include "control/Settings.h"
 #include "control/ClientPort.h"
+#include "config/get_key_name.h"
+#include <algorithm>
 #include <thread>
+#include <deque>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+
+#if !defined(_WIN32)
+# include <poll.h>
+# include <unistd.h>
+#endif
 
 namespace {
   enum Result : int {
@@ -20,6 +30,9 @@ namespace {
     std::optional<KeyState> state;
   };
   
+  // replies which are not read yet, before the batch waits for them
+  const auto max_pipelined_requests = size_t{ 64 };
+
   Settings g_settings;
   ClientPort g_client;
   std::string g_instance_id;
@@ -42,6 +55,10 @@ namespace {
 
   SendResult get_key_state(std::string_view key, 
       std::optional<Duration>timeout) {
+    if (const auto virtual_key = g_client.get_mapped_virtual_key(key);
+        virtual_key != Key::none)
+      return { Result::yes, g_client.get_mapped_virtual_key_state(virtual_key) };
+
     if (!g_client.send_get_virtual_key_state(key))
       return { Result::connection_failed };
     return read_virtual_key_state(timeout);
@@ -54,6 +71,16 @@ namespace {
     return read_virtual_key_state(timeout);
   }
 
+  SendResult wait_until_mapped_key_state(Key key, 
+      std::optional<KeyState> state, std::optional<Duration> timeout) {
+    auto result = std::optional<KeyState>();
+    if (!g_client.wait_mapped_virtual_key_state(key, state, timeout, &result))
+      return { Result::connection_failed };
+    if (!result.has_value())
+      return { Result::timeout };
+    return { Result::yes, result };
+  }
+
   Result to_result(SendResult send_result) {
     const auto [result, state] = send_result;
     return (result != Result::yes ? result :
@@ -124,43 +151,267 @@ namespace {
     return to_result(read_virtual_key_state(timeout));
   }
 
-  Result make_request(const Request& request, const Result& last_result) {
-    switch (request.type) {
+  // outputs a line for each state change, until keymapper disconnects
+  Result monitor_key_states(const std::string& key_list, 
+      std::optional<Duration> timeout) {
+    auto names = std::vector<std::string>();
+    auto stream = std::istringstream(key_list);
+    for (auto name = std::string(); stream >> name; )
+      names.push_back(name);
+    if (std::find(names.begin(), names.end(), "Any") != names.end())
+      names.clear();
+    if (!g_client.send_subscribe_virtual_key_states(names))
+      return Result::connection_failed;
+
+    // the first changes contain the current states of the keys
+    auto pending_replies = names.size();
+    auto key_names = std::vector<std::pair<Key, std::string>>();
+    const auto get_name = [&](Key key) {
+      for (const auto& [subscribed, name] : key_names)
+        if (subscribed == key)
+          return name;
+      // names which can be passed to keymapperctl again
+      if (key >= Key::first_auto_virtual)
+        return get_auto_virtual_name(key);
+      return "Virtual" + std::to_string(get_virtual_key_index(key));
+    };
+
+    const auto deadline = (timeout ? 
+      std::make_optional(Clock::now() + timeout.value()) : std::nullopt);
+    auto changes = std::vector<std::pair<Key, KeyState>>();
+    for (;;) {
+      auto remaining = std::optional<Duration>();
+      if (deadline) {
+        remaining = std::max(Duration(deadline.value() - Clock::now()),
+          Duration::zero());
+        if (remaining == Duration::zero())
+          return Result::timeout;
+      }
+      changes.clear();
+      if (!g_client.read_virtual_key_state_changes(remaining, &changes))
+        return Result::connection_failed;
+
+      for (const auto& [key, state] : changes) {
+        if (pending_replies > 0) {
+          const auto& name = names[names.size() - pending_replies--];
+          if (key == Key::none)
+            return Result::key_not_found;
+          key_names.emplace_back(key, name);
+        }
+        std::fprintf(stdout, "%s %s\n", get_name(key).c_str(),
+          (state == KeyState::Down ? "pressed" : "released"));
+      }
+      std::fflush(stdout);
+    }
+  }
+
+  KeyState get_requested_key_state(RequestType type) {
+    return (type == RequestType::press ? KeyState::Down :
+            type == RequestType::release ? KeyState::Up :
+            KeyState::Not);
+  }
+
+  // interprets the virtual key state keymapper replied to a request
+  Result to_request_result(RequestType type, SendResult send_result) {
+    const auto [result, state] = send_result;
+    switch (type) {
       case RequestType::press:
       case RequestType::release:
-      case RequestType::toggle: {
-        const auto [result, state] = set_key_state(request.string,
-            (request.type == RequestType::press ? KeyState::Down :
-             request.type == RequestType::release ? KeyState::Up :
-             KeyState::Not), request.timeout);
+      case RequestType::toggle:
         if (result == Result::yes) {
           if (state == KeyState::Up || state == KeyState::Down)
             return Result::yes;
           return Result::key_not_found;
         }
         return result;
-      }
 
       case RequestType::is_pressed:
-      case RequestType::is_released: {
-        const auto [result, state] = get_key_state(request.string, request.timeout);
+      case RequestType::is_released:
         if (result == Result::yes) {
           if (state == KeyState::Down)
-            return (request.type == RequestType::is_pressed ?
+            return (type == RequestType::is_pressed ?
               Result::yes : Result::no);
           
           if (state == KeyState::Up)
-            return (request.type == RequestType::is_released ?
+            return (type == RequestType::is_released ?
               Result::yes : Result::no);
           
           return Result::key_not_found;
         }
         return result;
+
+      default:
+        return to_result(send_result);
+    }
+  }
+
+  Result make_request(const Request& request, const Result& last_result);
+
+  // requests which are answered with a virtual key state, whose reply can
+  // be read later. the state of mapped keys is not sent when nothing is
+  // pending, since it can be read directly
+  bool can_pipeline(const Request& request, bool requests_pending) {
+    switch (request.type) {
+      case RequestType::press:
+      case RequestType::release:
+      case RequestType::toggle:
+      case RequestType::inject_input:
+      case RequestType::inject_output:
+      case RequestType::type_string:
+      case RequestType::notify:
+        return true;
+      case RequestType::is_pressed:
+      case RequestType::is_released:
+        return (requests_pending || 
+          g_client.get_mapped_virtual_key(request.string) == Key::none);
+      default:
+        return false;
+    }
+  }
+
+  bool send_pipelined_request(const Request& request) {
+    switch (request.type) {
+      case RequestType::press:
+      case RequestType::release:
+      case RequestType::toggle:
+        return g_client.send_set_key_state(request.string,
+          get_requested_key_state(request.type));
+      case RequestType::is_pressed:
+      case RequestType::is_released:
+        return g_client.send_get_virtual_key_state(request.string);
+      case RequestType::inject_input:
+        return g_client.send_inject_input(request.string);
+      case RequestType::inject_output:
+        return g_client.send_inject_output(request.string);
+      case RequestType::type_string:
+        return g_client.send_type_string(request.string);
+      case RequestType::notify:
+        return g_client.send_notify(request.string);
+      default:
+        return false;
+    }
+  }
+
+  bool is_allowed_in_batch(RequestType type) {
+    return (type != RequestType::restart &&
+            type != RequestType::type_stdin &&
+            type != RequestType::batch &&
+            type != RequestType::monitor);
+  }
+
+  bool outputs_result_in_batch(RequestType type) {
+    return (type != RequestType::wait &&
+            type != RequestType::print_string &&
+            type != RequestType::print_result);
+  }
+
+  bool has_pending_input(std::istream& input) {
+    if (&input != &std::cin || input.rdbuf()->in_avail() > 0)
+      return true;
+#if !defined(_WIN32)
+    auto pfd = pollfd{ STDIN_FILENO, POLLIN, 0 };
+    return (::poll(&pfd, 1, 0) > 0);
+#else
+    return false;
+#endif
+  }
+
+  // requests are sent without waiting for the replies, they are read
+  // before a request depends on them, or when no further input is available
+  Result run_batch(const std::string& filename) {
+    auto file = std::ifstream();
+    if (!filename.empty()) {
+      file.open(filename);
+      if (!file.good())
+        return Result::invalid_arguments;
+    }
+    else {
+      // so the buffered input can be checked
+      std::ios::sync_with_stdio(false);
+    }
+    auto& input = (filename.empty() ? std::cin : file);
+
+    struct PendingRequest {
+      RequestType type;
+      std::optional<Duration> timeout;
+    };
+    auto pending = std::deque<PendingRequest>();
+    auto result = Result::yes;
+    const auto output_result = [&](Result request_result) {
+      result = request_result;
+      std::fprintf(stdout, "%d\n", static_cast<int>(result));
+    };
+    const auto read_replies = [&]() {
+      for (const auto& request : pending)
+        output_result(to_request_result(request.type,
+          read_virtual_key_state(request.timeout)));
+      pending.clear();
+      std::fflush(stdout);
+    };
+
+    auto line = std::string();
+    while (result != Result::connection_failed && std::getline(input, line)) {
+      auto settings = Settings();
+      if (!interpret_batch_line(settings, line)) {
+        read_replies();
+        output_result(Result::invalid_arguments);
+        continue;
+      }
+      for (const auto& request : settings.requests) {
+        if (!is_allowed_in_batch(request.type)) {
+          read_replies();
+          output_result(Result::invalid_arguments);
+        }
+        else if (can_pipeline(request, !pending.empty())) {
+          if (!send_pipelined_request(request)) {
+            read_replies();
+            output_result(Result::connection_failed);
+            break;
+          }
+          pending.push_back({ request.type, request.timeout });
+          if (pending.size() >= max_pipelined_requests)
+            read_replies();
+        }
+        else {
+          read_replies();
+          const auto request_result = make_request(request, result);
+          if (outputs_result_in_batch(request.type))
+            output_result(request_result);
+        }
       }
+      if (!has_pending_input(input))
+        read_replies();
+    }
+    read_replies();
+    return result;
+  }
+
+  Result make_request(const Request& request, const Result& last_result) {
+    switch (request.type) {
+      case RequestType::press:
+      case RequestType::release:
+      case RequestType::toggle:
+        return to_request_result(request.type, 
+          set_key_state(request.string, 
+            get_requested_key_state(request.type), request.timeout));
+
+      case RequestType::is_pressed:
+      case RequestType::is_released:
+        return to_request_result(request.type, 
+          get_key_state(request.string, request.timeout));
 
       case RequestType::wait_pressed:
       case RequestType::wait_released:
       case RequestType::wait_toggled: {
+        if (const auto key = g_client.get_mapped_virtual_key(request.string);
+            key != Key::none)
+          return wait_until_mapped_key_state(key,
+            (request.type == RequestType::wait_pressed ? 
+              std::make_optional(KeyState::Down) :
+             request.type == RequestType::wait_released ? 
+              std::make_optional(KeyState::Up) : std::nullopt),
+            request.timeout).result;
+
         const auto [result, state] = get_key_state(request.string, request.timeout);
         if (result == Result::yes) {
           if ((request.type == RequestType::wait_pressed && state == KeyState::Down) || 
@@ -212,6 +463,12 @@ namespace {
 
       case RequestType::notify:
         return notify(request.string, request.timeout);
+
+      case RequestType::batch:
+        return run_batch(request.string);
+
+      case RequestType::monitor:
+        return monitor_key_states(request.string, request.timeout);
     }
     return last_result;
   }
@@ -22,6 +22,7 @@ enum class KeyState : uint16_t {
   DownMatched,     // only in sequence
   UpMatched,       // only in sequence
   HistoryTiming,   // only in history sequence
+  OutputDelay,     // only in output of stage
 
   // only in input timeout events (mostly renaming standard states)
   NotTimeout_cancel_on_up_down,
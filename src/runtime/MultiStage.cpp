@@ -22,6 +22,11 @@ bool MultiStage::has_mouse_mappings() const {
     [](const auto& stage) { return stage->has_mouse_mappings(); });
 }
 
+bool MultiStage::has_wheel_mappings() const {
+  return std::any_of(begin(m_stages), end(m_stages), 
+    [](const auto& stage) { return stage->has_wheel_mappings(); });
+}
+
 bool MultiStage::has_device_filters() const {
   return std::any_of(begin(m_stages), end(m_stages), 
     [](const auto& stage) { return stage->has_device_filters(); });
@@ -79,13 +84,14 @@ KeySequence MultiStage::set_active_client_contexts(const std::vector<int>& indic
   return m_output_buffer;
 }
 
-KeySequence MultiStage::update(KeyEvent event, int device_index) {  
+KeySequence MultiStage::update(KeyEvent event, int device_index,
+    std::optional<std::chrono::steady_clock::time_point> time) {
   m_output_buffer.push_back(event);
   
   auto first_stage = true;
   for (const auto& stage : m_stages) {
     const auto update_stage = [&](const KeyEvent& event) {
-      auto output = stage->update(event, device_index);
+      auto output = stage->update(event, device_index, time);
       m_output_buffer.insert(m_output_buffer.end(), 
         output.begin(), output.end());
       stage->reuse_buffer(std::move(output));
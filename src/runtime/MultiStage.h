@@ -13,13 +13,15 @@ public:
   const std::vector<StagePtr>& stages() const { return m_stages; }
   const std::vector<int>& active_client_contexts() const { return m_active_client_contexts; }
   bool has_mouse_mappings() const;
+  bool has_wheel_mappings() const;
   bool has_device_filters() const;
 
   bool is_clear() const;
   std::vector<Key> get_output_keys_down() const;
   void evaluate_device_filters(const std::vector<DeviceDesc>& device_descs);
   KeySequence set_active_client_contexts(const std::vector<int>& indices);
-  KeySequence update(KeyEvent event, int device_index);
+  KeySequence update(KeyEvent event, int device_index,
+    std::optional<std::chrono::steady_clock::time_point> time = { });
   void reuse_buffer(KeySequence&& buffer);
   void validate_state(const std::function<bool(Key)>& is_down);
   bool should_exit() const;
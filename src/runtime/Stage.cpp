@@ -83,6 +83,22 @@ namespace {
     return false;
   }
 
+  bool has_wheel_mappings(const KeySequence& sequence) {
+    return std::any_of(begin(sequence), end(sequence),
+      [](const KeyEvent& event) { return is_mouse_wheel(event.key); });
+  }
+
+  bool has_wheel_mappings(const std::vector<Stage::Context>& contexts) {
+    for (const auto& context : contexts) {
+      if (has_wheel_mappings(context.modifier_filter))
+        return true;
+      for (const auto& input : context.inputs)
+        if (has_wheel_mappings(input.input))
+          return true;
+    }
+    return false;
+  }
+
   bool has_device_filter(const Stage::Context& context) {
     return (context.device_filter ||
             context.device_id_filter);
@@ -108,6 +124,24 @@ namespace {
     return false;
   }
 
+  // keys which appear in an input or modifier filter
+  std::vector<bool> get_mapped_keys(const std::vector<Stage::Context>& contexts) {
+    auto mapped_keys = std::vector<bool>(*Key::last_keyboard_key + 1);
+    const auto add_keys = [&](const KeySequence& sequence) {
+      for (const auto& event : sequence)
+        if (event.key == Key::any)
+          std::fill(mapped_keys.begin(), mapped_keys.end(), true);
+        else if (*event.key < mapped_keys.size())
+          mapped_keys[*event.key] = true;
+    };
+    for (const auto& context : contexts) {
+      add_keys(context.modifier_filter);
+      for (const auto& input : context.inputs)
+        add_keys(input.input);
+    }
+    return mapped_keys;
+  }
+
   const KeyEvent* find_last_down_event(ConstKeySequenceRange sequence) {
     auto last = std::add_pointer_t<const KeyEvent>{ };
     for (const auto& event : sequence)
@@ -151,8 +185,10 @@ namespace {
 Stage::Stage(std::vector<Context> contexts)
   : m_contexts(sort_command_outputs(std::move(contexts))),
     m_has_mouse_mappings(::has_mouse_mappings(m_contexts)),
+    m_has_wheel_mappings(::has_wheel_mappings(m_contexts)),
     m_has_device_filter(::has_device_filter(m_contexts)),
-    m_has_no_might_match_mapping(::has_no_might_match_mapping(m_contexts)) {
+    m_has_no_might_match_mapping(::has_no_might_match_mapping(m_contexts)),
+    m_mapped_keys(get_mapped_keys(m_contexts)) {
 }
 
 bool Stage::is_clear() const {
@@ -342,7 +378,9 @@ bool Stage::should_exit() const {
   return (m_exit_sequence_position == exit_sequence.size());
 }
 
-KeySequence Stage::update(const KeyEvent event, int device_index) {
+KeySequence Stage::update(const KeyEvent event, int device_index,
+    std::optional<std::chrono::steady_clock::time_point> time) {
+  m_event_time = time;
   advance_exit_sequence(event);
   apply_input(event, device_index);
   return std::move(m_output_buffer);
@@ -444,6 +482,24 @@ bool Stage::is_physically_pressed(Key key) const {
   return (it != cend(m_sequence) && it->state != KeyState::Up);
 }
 
+bool Stage::can_bypass_matching(const KeyEvent& event) const {
+  if (!m_bypass_unmapped_keys ||
+      !is_device_key(event.key) ||
+      m_mapped_keys[*event.key] ||
+      m_has_no_might_match_mapping ||
+      m_sequence_might_match ||
+      m_current_timeout)
+    return false;
+
+  // everything in the sequence must already be matched
+  if (!std::all_of(m_sequence.begin(), m_sequence.end(),
+        [](const KeyEvent& e) { return e.state == KeyState::DownMatched; }))
+    return false;
+
+  return std::none_of(m_output_on_release.begin(), m_output_on_release.end(),
+    [&](const OutputOnRelease& o) { return o.trigger == event.key; });
+}
+
 void Stage::apply_input(const KeyEvent event, int device_index) {
   assert(event.state == KeyState::Down ||
          event.state == KeyState::Up);
@@ -452,6 +508,10 @@ void Stage::apply_input(const KeyEvent event, int device_index) {
          event.key == Key::timeout ||
          event.key == Key::unicode_output);
 
+  // unmapped keys cannot match, when nothing is pending the
+  // result of the matching is known in advance
+  const auto bypass_matching = can_bypass_matching(event);
+
   // check if key triggers an output on release
   if (!continue_output_on_release(event))
     return;
@@ -505,6 +565,24 @@ void Stage::apply_input(const KeyEvent event, int device_index) {
       m_last_repeat_device_index = no_device_index;
   }
 
+  if (bypass_matching) {
+    if (event.state == KeyState::Down) {
+      m_sequence.push_back(event);
+      m_sequence.back().state = KeyState::DownMatched;
+      reset_output_suppression();
+      update_output(event, event.key);
+    }
+    else {
+      const auto it = find_key(m_sequence, event.key);
+      if (it != m_sequence.end())
+        m_sequence.erase(it);
+      reset_output_suppression();
+      release_triggered(event.key);
+    }
+    m_temporary_reapplied = false;
+    return;
+  }
+
   // add to sequence
   m_sequence.push_back(event);
 
@@ -535,19 +613,7 @@ void Stage::apply_input(const KeyEvent event, int device_index) {
     }
   }
 
-  const auto is_unsuppressed_common_modifier_down =
-    std::any_of(m_output_down.begin(), m_output_down.end(),
-      [](const OutputDown& output) {
-        return (is_common_modifier(output.key) && !output.suppressed);
-      });
-
-  for (auto& output : m_output_down) {
-    // keep suppressing common modifiers as long as a common modifier is still output
-    if (is_common_modifier(output.key) && is_unsuppressed_common_modifier_down)
-      continue;
-
-    output.suppressed = false;
-  }
+  reset_output_suppression();
 
   auto matched_are_optional = false;
 
@@ -702,6 +768,22 @@ void Stage::apply_input(const KeyEvent event, int device_index) {
   clean_up_history();
 }
 
+void Stage::reset_output_suppression() {
+  const auto is_unsuppressed_common_modifier_down =
+    std::any_of(m_output_down.begin(), m_output_down.end(),
+      [](const OutputDown& output) {
+        return (is_common_modifier(output.key) && !output.suppressed);
+      });
+
+  for (auto& output : m_output_down) {
+    // keep suppressing common modifiers as long as a common modifier is still output
+    if (is_common_modifier(output.key) && is_unsuppressed_common_modifier_down)
+      continue;
+
+    output.suppressed = false;
+  }
+}
+
 bool Stage::continue_output_on_release(const KeyEvent& event, int context_index) {
   // there can be multiple entries with the same trigger
   for (;;) {
@@ -926,7 +1008,11 @@ void Stage::update_output(const KeyEvent& event, const Trigger& trigger, int con
           it->pressed_twice = false;
         }
       }
-      m_output_buffer.push_back(event);
+      // distinguish delays from requests for input timeouts
+      if (event.key == Key::timeout)
+        m_output_buffer.emplace_back(Key::timeout, KeyState::OutputDelay, event.value);
+      else
+        m_output_buffer.push_back(event);
       break;
     }
 
@@ -940,6 +1026,7 @@ void Stage::update_output(const KeyEvent& event, const Trigger& trigger, int con
     case KeyState::UpAsync:
     case KeyState::DownAsync:
     case KeyState::OutputOnRelease:
+    case KeyState::OutputDelay:
     case KeyState::NotTimeout_cancel_on_up_down:
       assert(!"unreachable");
       break;
@@ -1003,10 +1090,10 @@ KeyEvent Stage::update_history_timing() {
   if (const auto* timeout = std::get_if<std::chrono::milliseconds>(&m_history_timing_state))
     return make_history_timeout_event(*timeout);
 
-  // generate timing using wall clock
+  // generate timing using time of event or wall clock
   using Clock = std::chrono::steady_clock;
   auto& last_event_time = std::get<Clock::time_point>(m_history_timing_state);
-  const auto now = Clock::now();
+  const auto now = std::max(m_event_time.value_or(Clock::now()), last_event_time);
   const auto time_elapsed = (now - last_event_time);
   last_event_time = now;
   return make_history_timeout_event(time_elapsed);
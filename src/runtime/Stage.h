@@ -5,6 +5,7 @@
 #include "common/Filter.h"
 #include <chrono>
 #include <functional>
+#include <optional>
 #include <variant>
 
 using Trigger = std::variant<const KeySequence*, KeyEvent, Key>;
@@ -43,10 +44,12 @@ public:
 
   explicit Stage(std::vector<Context> contexts = { });
   void set_virtual_keys_toggle(bool set) { m_virtual_keys_toggle = set; }
+  void set_bypass_unmapped_keys(bool set) { m_bypass_unmapped_keys = set; }
 
   const std::vector<Context>& contexts() const { return m_contexts; }
   const std::vector<int>& active_client_contexts() const { return m_active_client_contexts; }
   bool has_mouse_mappings() const { return m_has_mouse_mappings; }
+  bool has_wheel_mappings() const { return m_has_wheel_mappings; }
   bool has_device_filters() const { return m_has_device_filter; }
 
   bool is_clear() const;
@@ -56,7 +59,8 @@ public:
   void evaluate_device_filters(const std::vector<DeviceDesc>& device_descs);
   KeySequence set_active_client_contexts(const std::vector<int>& indices);
   void set_history_timing(std::chrono::milliseconds timeout);
-  KeySequence update(KeyEvent event, int device_index);
+  KeySequence update(KeyEvent event, int device_index,
+    std::optional<std::chrono::steady_clock::time_point> time = { });
   void reuse_buffer(KeySequence&& buffer);
   void validate_state(const std::function<bool(Key)>& is_down);
   bool should_exit() const;
@@ -71,7 +75,9 @@ private:
     ConstKeySequenceRange sequence, int device_index, 
     bool is_key_up_event);
   bool is_physically_pressed(Key key) const;
+  bool can_bypass_matching(const KeyEvent& event) const;
   void apply_input(KeyEvent event, int device_index);
+  void reset_output_suppression();
   void release_triggered(Key key, int context_index = -1);
   void forward_from_sequence();
   void apply_output(ConstKeySequenceRange sequence,
@@ -93,9 +99,12 @@ private:
 
   std::vector<Context> m_contexts;
   bool m_has_mouse_mappings{ };
+  bool m_has_wheel_mappings{ };
   bool m_has_device_filter{ };
   bool m_has_no_might_match_mapping{ };
+  std::vector<bool> m_mapped_keys;
   bool m_virtual_keys_toggle{ true };
+  bool m_bypass_unmapped_keys{ true };
   std::vector<int> m_active_client_contexts;
   std::vector<int> m_active_contexts;
   std::vector<int> m_prev_active_contexts;
@@ -111,6 +120,7 @@ private:
   // the input which might still match a no-might-match mapping
   KeySequence m_history;
   HistoryTimingState m_history_timing_state;
+  std::optional<std::chrono::steady_clock::time_point> m_event_time;
 
   struct OutputOnRelease {
     Key trigger;
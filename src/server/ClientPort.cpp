@@ -1,14 +1,16 @@
 
 #include "ClientPort.h"
 #include "common/parse_regex.h"
+#include "common/output.h"
+#include <algorithm>
 
 namespace {
   KeySequence read_key_sequence(Deserializer& d) {
     auto sequence = KeySequence();
-    auto size = d.read<uint32_t>();
-    for (auto i = 0u; i < size; ++i) {
-      auto& event = sequence.emplace_back();
-      d.read(&event);
+    const auto size = d.read<uint32_t>();
+    if (d.can_read(sizeof(KeyEvent) * size)) {
+      sequence.resize(size);
+      d.read(sequence.data(), sizeof(KeyEvent) * size);
     }
     return sequence;
   }
@@ -22,62 +24,70 @@ namespace {
     return filter;
   }
 
-  MultiStagePtr read_stages(Deserializer& d) {
-    auto stages = std::vector<StagePtr>();
-    auto contexts = std::vector<Stage::Context>();
-    const auto context_count = d.read<uint32_t>();
-    for (auto i = 0u; i < context_count; ++i) {
-      // begin stage
-      auto begin_stage = false;
-      d.read(&begin_stage);
-      if (begin_stage && !contexts.empty()) {
-        stages.emplace_back(std::make_unique<Stage>(std::move(contexts)));
-        contexts = { };
-      }
+  Stage::Context read_context(Deserializer& d) {
+    auto context = Stage::Context();
 
-      auto& context = contexts.emplace_back();
+    // inputs
+    auto count = d.read<uint32_t>();
+    context.inputs.resize(count);
+    for (auto& input : context.inputs) {
+      input.input = read_key_sequence(d);
+      input.output_index = d.read<int32_t>();
+    }
 
-      // inputs
-      auto count = d.read<uint32_t>();
-      context.inputs.resize(count);
-      for (auto& input : context.inputs) {
-        input.input = read_key_sequence(d);
-        input.output_index = d.read<int32_t>();
-      }
+    // outputs
+    count = d.read<uint32_t>();
+    context.outputs.resize(count);
+    for (auto& output : context.outputs) {
+      output = read_key_sequence(d);
+    }
 
-      // outputs
-      count = d.read<uint32_t>();
-      context.outputs.resize(count);
-      for (auto& output : context.outputs) {
-        output = read_key_sequence(d);
-      }
+    // command outputs
+    count = d.read<uint32_t>();
+    context.command_outputs.resize(count);
+    for (auto& command : context.command_outputs) {
+      command.output = read_key_sequence(d);
+      command.index = d.read<int32_t>();
+    }
 
-      // command outputs
-      count = d.read<uint32_t>();
-      context.command_outputs.resize(count);
-      for (auto& command : context.command_outputs) {
-        command.output = read_key_sequence(d);
-        command.index = d.read<int32_t>();
-      }
+    // device filter
+    context.device_filter = read_filter(d);
 
-      // device filter
-      context.device_filter = read_filter(d);
+    // device-id filter
+    context.device_id_filter = read_filter(d);
 
-      // device-id filter
-      context.device_id_filter = read_filter(d);
+    // modifier filter
+    context.modifier_filter = read_key_sequence(d);
+    d.read(&context.invert_modifier_filter);
 
-      // modifier filter
-      context.modifier_filter = read_key_sequence(d);
-      d.read(&context.invert_modifier_filter);
+    // fallthrough
+    d.read(&context.fallthrough);
+    return context;
+  }
 
-      // fallthrough
-      d.read(&context.fallthrough);
+  std::vector<ConfigurationDelta::Context> read_contexts(Deserializer& d) {
+    auto contexts = std::vector<ConfigurationDelta::Context>();
+    const auto context_count = d.read<uint32_t>();
+    for (auto i = 0u; i < context_count; ++i) {
+      auto& context = contexts.emplace_back();
+      // begin stage
+      d.read(&context.begin_stage);
+      context.context = std::make_shared<const Stage::Context>(read_context(d));
     }
+    return contexts;
+  }
 
-    if (!contexts.empty())
-      stages.emplace_back(std::make_unique<Stage>(std::move(contexts)));
-
-    return std::make_unique<MultiStage>(std::move(stages));
+  ConfigurationDelta read_configuration_delta(Deserializer& d) {
+    auto delta = ConfigurationDelta{ };
+    const auto context_count = d.read<uint32_t>();
+    for (auto i = 0u; i < context_count; ++i) {
+      auto& context = delta.contexts.emplace_back();
+      context.current_index = d.read<int32_t>();
+      d.read(&context.begin_stage);
+      if (context.current_index < 0)
+        context.context = std::make_shared<const Stage::Context>(read_context(d));
+    }
+    return delta;
   }
 
   std::vector<GrabDeviceFilter> read_grab_device_filters(Deserializer& d) {
@@ -105,6 +115,10 @@ namespace {
     for (auto i = 0u; i < count; ++i)
       indices->push_back(static_cast<int>(d.read<uint32_t>()));
   }
+
+  // messages which the client did not accept yet are dropped above
+  const auto max_queued_size = size_t{ 256 * 1024 };
+  const auto max_pending_messages = size_t{ 1024 };
 } // namespace
 
 ClientPort::ClientPort() 
@@ -116,12 +130,16 @@ bool ClientPort::listen() {
 }
 
 bool ClientPort::accept() {
-  m_connection = m_host.accept();
+  m_connection = m_host.accept(std::nullopt, true);
+  m_pending_messages.clear();
+  m_configurations.clear();
+  m_configuration_requested = false;
   return static_cast<bool>(m_connection);
 }
 
 void ClientPort::disconnect() {
   m_connection.disconnect();
+  m_pending_messages.clear();
 }
 
 const std::vector<int>& ClientPort::read_active_contexts(Deserializer& d) {
@@ -129,8 +147,24 @@ const std::vector<int>& ClientPort::read_active_contexts(Deserializer& d) {
   return m_active_context_indices;
 }
 
+// messages are only queued and sent without blocking by flush_messages
 bool ClientPort::send_triggered_action(int action) {
-  return m_connection.send_message(
+  if (m_connection.queued_size() > max_queued_size)
+    return false;
+
+  // keep order with the virtual key states, which are held back
+  if (!m_pending_messages.empty()) {
+    if (m_pending_messages.size() >= max_pending_messages)
+      return false;
+    m_pending_messages.emplace_back(get_action_key(action), KeyState::Down);
+    return true;
+  }
+  queue_triggered_action(action);
+  return true;
+}
+
+void ClientPort::queue_triggered_action(int action) {
+  m_connection.queue_message(
     [&](Serializer& s) {
       s.write(MessageType::execute_action);
       s.write(static_cast<uint32_t>(action));
@@ -138,7 +172,25 @@ bool ClientPort::send_triggered_action(int action) {
 }
 
 bool ClientPort::send_virtual_key_state(Key key, KeyState state) {
-  return m_connection.send_message(
+  // while client is not accepting messages, only keep the last state,
+  // unless an action was triggered after it
+  if (m_connection.queued_size() || !m_pending_messages.empty()) {
+    const auto it = std::find_if(m_pending_messages.rbegin(),
+      m_pending_messages.rend(), [&](const auto& pending) {
+        return (pending.first == key || is_action_key(pending.first));
+      });
+    if (it != m_pending_messages.rend() && it->first == key)
+      it->second = state;
+    else
+      m_pending_messages.emplace_back(key, state);
+    return true;
+  }
+  queue_virtual_key_state(key, state);
+  return true;
+}
+
+void ClientPort::queue_virtual_key_state(Key key, KeyState state) {
+  m_connection.queue_message(
     [&](Serializer& s) {
       s.write(MessageType::virtual_key_state);
       s.write(key);
@@ -147,13 +199,123 @@ bool ClientPort::send_virtual_key_state(Key key, KeyState state) {
 }
 
 bool ClientPort::send_next_key_info(const std::vector<Key>& keys, const DeviceDesc& device_desc) {
-  return m_connection.send_message(
+  if (m_connection.queued_size() > max_queued_size)
+    return false;
+  m_connection.queue_message(
     [&](Serializer& s) {
       s.write(MessageType::next_key_info);
       s.write(keys);
       s.write(device_desc.name);
       s.write(device_desc.id);
     });
+  return true;
+}
+
+bool ClientPort::flush_messages() {
+  if (!m_connection.flush(false))
+    return false;
+
+  // send merged virtual key states once the previous messages were sent
+  if (m_connection.queued_size() || m_pending_messages.empty())
+    return true;
+  for (const auto& [key, state] : m_pending_messages) {
+    if (is_action_key(key))
+      queue_triggered_action(get_action_index(key));
+    else
+      queue_virtual_key_state(key, state);
+  }
+  m_pending_messages.clear();
+  return m_connection.flush(false);
+}
+
+bool ClientPort::has_queued_messages() const {
+  return (m_connection.queued_size() || !m_pending_messages.empty());
+}
+
+auto ClientPort::read_configuration(Deserializer& d) -> CachedConfiguration {
+  auto config = CachedConfiguration{ };
+  config.grab_device_filters = read_grab_device_filters(d);
+  config.contexts = read_contexts(d);
+  config.directives = read_directives(d);
+  return config;
+}
+
+void ClientPort::apply_configuration(uint64_t hash, 
+    CachedConfiguration config, MessageHandler& handler) {
+  m_configuration_requested = false;
+  handler.on_grab_device_filters_message(config.grab_device_filters);
+  if (!handler.on_configuration_message(make_multi_stage(config.contexts)))
+    return request_configuration();
+  handler.on_directives_message(config.directives);
+  m_configurations.insert(hash, std::move(config));
+}
+
+void ClientPort::apply_configuration_delta(uint64_t hash, Deserializer& d,
+    MessageHandler& handler) {
+  auto delta = read_configuration_delta(d);
+  auto grab_device_filters = std::optional<std::vector<GrabDeviceFilter>>();
+  if (d.read<bool>())
+    grab_device_filters = read_grab_device_filters(d);
+  auto directives = std::optional<std::vector<std::string>>();
+  if (d.read<bool>())
+    directives = read_directives(d);
+
+  // delta refers to a configuration which was not applied
+  if (m_configuration_requested)
+    return;
+  const auto current = m_configurations.front();
+  if (!current)
+    return request_configuration();
+
+  // resolve unchanged parts from current configuration
+  const auto unchanged = is_unchanged_configuration(delta,
+    current->contexts.size());
+  auto contexts = resolve_configuration_delta(std::move(delta),
+    current->contexts);
+  if (!contexts) {
+    error("Receiving configuration failed");
+    return request_configuration();
+  }
+  auto config = CachedConfiguration{ };
+  config.grab_device_filters = (grab_device_filters ? 
+    *grab_device_filters : current->grab_device_filters);
+  config.directives = (directives ? *directives : current->directives);
+  config.contexts = std::move(*contexts);
+
+  if (grab_device_filters)
+    handler.on_grab_device_filters_message(std::move(*grab_device_filters));
+  // keep configuration and its state when no context changed
+  if (!unchanged &&
+      !handler.on_configuration_message(make_multi_stage(config.contexts)))
+    return request_configuration();
+  if (directives)
+    handler.on_directives_message(*directives);
+  m_configurations.insert(hash, std::move(config));
+}
+
+void ClientPort::apply_cached_configuration(uint64_t hash, 
+    MessageHandler& handler) {
+  if (m_configuration_requested)
+    return;
+  const auto config = m_configurations.find(hash);
+  if (!config)
+    return request_configuration();
+  handler.on_grab_device_filters_message(config->grab_device_filters);
+  if (!handler.on_configuration_message(make_multi_stage(config->contexts)))
+    return request_configuration();
+  handler.on_directives_message(config->directives);
+}
+
+// the client sends the complete configuration again, since the current
+// one, which further updates refer to, could not be applied
+void ClientPort::request_configuration() {
+  // ignore updates until it arrives
+  verbose("Requesting configuration");
+  m_configuration_requested = true;
+  m_connection.queue_message([](Serializer& s) {
+    s.write(MessageType::configuration_requested);
+  });
+  flush_messages();
 }
 
 bool ClientPort::read_messages(MessageHandler& handler,
@@ -162,13 +324,25 @@ bool ClientPort::read_messages(MessageHandler& handler,
     [&](Deserializer& d) {
       switch (d.read<MessageType>()) {
         case MessageType::configuration: {
-          handler.on_grab_device_filters_message(read_grab_device_filters(d));        
-          handler.on_configuration_message(read_stages(d));
-          handler.on_directives_message(read_directives(d));
+          const auto hash = d.read<uint64_t>();
+          apply_configuration(hash, read_configuration(d), handler);
+          break;
+        }
+        case MessageType::configuration_delta: {
+          const auto hash = d.read<uint64_t>();
+          apply_configuration_delta(hash, d, handler);
+          break;
+        }
+        case MessageType::configuration_cached: {
+          const auto hash = d.read<uint64_t>();
+          apply_cached_configuration(hash, handler);
           break;
         }
         case MessageType::active_contexts: {
-          handler.on_active_contexts_message(read_active_contexts(d));
+          // indices refer to the configuration which is still missing
+          const auto& indices = read_active_contexts(d);
+          if (!m_configuration_requested)
+            handler.on_active_contexts_message(indices);
           break;
         }
         case MessageType::set_virtual_key_state: {
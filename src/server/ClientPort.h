@@ -4,12 +4,71 @@
 #include "common/MessageType.h"
 #include "common/Host.h"
 #include "common/DeviceDesc.h"
+#include "common/LruCache.h"
 #include <memory>
+#include <optional>
+
+// contexts of a configuration update, unchanged contexts are not sent again
+struct ConfigurationDelta {
+  struct Context {
+    bool begin_stage{ };
+    // index of unchanged context in current configuration or -1
+    int current_index{ -1 };
+    // shared by the cached configurations which contain it unchanged
+    std::shared_ptr<const Stage::Context> context;
+  };
+  std::vector<Context> contexts;
+};
+
+// a new stage begins at the contexts with begin_stage set
+inline MultiStagePtr make_multi_stage(
+    const std::vector<ConfigurationDelta::Context>& contexts) {
+  auto stages = std::vector<StagePtr>();
+  auto stage_contexts = std::vector<Stage::Context>();
+  for (const auto& context : contexts) {
+    if (context.begin_stage && !stage_contexts.empty()) {
+      stages.emplace_back(std::make_unique<Stage>(std::move(stage_contexts)));
+      stage_contexts = { };
+    }
+    stage_contexts.push_back(*context.context);
+  }
+  if (!stage_contexts.empty())
+    stages.emplace_back(std::make_unique<Stage>(std::move(stage_contexts)));
+
+  return std::make_unique<MultiStage>(std::move(stages));
+}
+
+// whether the delta keeps all contexts of the current configuration
+inline bool is_unchanged_configuration(const ConfigurationDelta& delta,
+    size_t current_context_count) {
+  if (delta.contexts.size() != current_context_count)
+    return false;
+  for (auto i = 0u; i < delta.contexts.size(); ++i)
+    if (delta.contexts[i].current_index != static_cast<int>(i))
+      return false;
+  return true;
+}
+
+// copies the unchanged contexts from the current configuration,
+// fails when the delta refers to contexts which do not exist
+inline std::optional<std::vector<ConfigurationDelta::Context>> 
+    resolve_configuration_delta(ConfigurationDelta delta,
+      const std::vector<ConfigurationDelta::Context>& current) {
+  for (auto& context : delta.contexts) {
+    if (context.current_index < 0)
+      continue;
+    if (context.current_index >= static_cast<int>(current.size()))
+      return std::nullopt;
+    context.context = current[static_cast<size_t>(context.current_index)].context;
+    context.current_index = -1;
+  }
+  return std::move(delta.contexts);
+}
 
 class IClientPort {
 public:
   struct MessageHandler {
-    virtual void on_configuration_message(MultiStagePtr stage) = 0;
+    virtual bool on_configuration_message(MultiStagePtr stage) = 0;
     virtual void on_grab_device_filters_message(std::vector<GrabDeviceFilter> filters) = 0;
     virtual void on_directives_message(const std::vector<std::string>& directives) = 0;
     virtual void on_active_contexts_message(const std::vector<int>& context_indices) = 0;
@@ -30,6 +89,8 @@ public:
   virtual bool send_triggered_action(int action) = 0;
   virtual bool send_virtual_key_state(Key key, KeyState state) = 0;
   virtual bool send_next_key_info(const std::vector<Key>& keys, const DeviceDesc& device_desc) = 0;
+  virtual bool flush_messages() = 0;
+  virtual bool has_queued_messages() const = 0;
   virtual bool read_messages(MessageHandler& handler, 
     std::optional<Duration> timeout) = 0;
 };
@@ -46,13 +107,36 @@ public:
   bool send_triggered_action(int action) override;
   bool send_virtual_key_state(Key key, KeyState state) override;
   bool send_next_key_info(const std::vector<Key>& keys, const DeviceDesc& device_desc) override;
+  bool flush_messages() override;
+  bool has_queued_messages() const override;
   bool read_messages(MessageHandler& handler, 
     std::optional<Duration> timeout) override;
 
 private:
+  // deserialized configuration, which can be applied again by its hash
+  struct CachedConfiguration {
+    std::vector<GrabDeviceFilter> grab_device_filters;
+    std::vector<ConfigurationDelta::Context> contexts;
+    std::vector<std::string> directives;
+  };
+
+  static CachedConfiguration read_configuration(Deserializer& d);
   const std::vector<int>& read_active_contexts(Deserializer& d);
+  void queue_triggered_action(int action);
+  void queue_virtual_key_state(Key key, KeyState state);
+  void apply_configuration(uint64_t hash, CachedConfiguration config,
+    MessageHandler& handler);
+  void apply_configuration_delta(uint64_t hash, Deserializer& d,
+    MessageHandler& handler);
+  void apply_cached_configuration(uint64_t hash, MessageHandler& handler);
+  void request_configuration();
 
   Host m_host;
   Connection m_connection;
   std::vector<int> m_active_context_indices;
+  // virtual key states and triggered actions (as action keys) in order
+  std::vector<std::pair<Key, KeyState>> m_pending_messages;
+  LruCache<uint64_t, CachedConfiguration> m_configurations{ 
+    configuration_cache_size };
+  bool m_configuration_requested{ };
 };
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "common/Duration.h"
+#include "common/output.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+// keeps the most recent samples to calculate rolling percentiles
+class LatencyStats {
+public:
+  static constexpr size_t max_samples = 4096;
+
+  void add(Duration latency) {
+    const auto us = std::chrono::duration_cast<
+      std::chrono::microseconds>(latency).count();
+    m_samples[m_count % max_samples] = static_cast<int64_t>(std::max(us, decltype(us){ }));
+    ++m_count;
+  }
+
+  size_t count() const {
+    return m_count;
+  }
+
+  // percentile in range [0, 100] in microseconds
+  int64_t percentile(double percent) const {
+    const auto size = std::min(m_count, max_samples);
+    if (!size)
+      return 0;
+    auto sorted = m_samples;
+    const auto begin = sorted.begin();
+    const auto nth = begin + static_cast<size_t>(percent / 100.0 * (size - 1) + 0.5);
+    std::nth_element(begin, nth, begin + size);
+    return *nth;
+  }
+
+  void print(const char* name) const {
+    message("  %-10s p50 %6lldus  p90 %6lldus  p99 %6lldus  max %6lldus  (%zu)",
+      name,
+      static_cast<long long>(percentile(50)),
+      static_cast<long long>(percentile(90)),
+      static_cast<long long>(percentile(99)),
+      static_cast<long long>(percentile(100)),
+      m_count);
+  }
+
+private:
+  std::array<int64_t, max_samples> m_samples{ };
+  size_t m_count{ };
+};
@@ -9,10 +9,15 @@ ServerState::ServerState(std::unique_ptr<IClientPort> client)
     m_stage(std::make_unique<MultiStage>()) {
 }
 
-void ServerState::on_configuration_message(std::unique_ptr<MultiStage> stage) {
-  if (!stage)
-    return error("Receiving configuration failed");
+bool ServerState::on_configuration_message(std::unique_ptr<MultiStage> stage) {
+  if (!stage) {
+    error("Receiving configuration failed");
+    return false;
+  }
   reset_configuration(std::move(stage));  
+  // directives are not sent again when they did not change
+  apply_stage_directives();
+  return true;
 }
 
 void ServerState::on_directives_message(const std::vector<std::string>& directives) {
@@ -20,9 +25,13 @@ void ServerState::on_directives_message(const std::vector<std::string>& directiv
     return (std::count(begin(directives), end(directives), name) > 0);
   };
 
-  if (is_enabled("disable-virtual-keys-toggle"))
-    for (const auto& stage : m_stage->stages())
-      stage->set_virtual_keys_toggle(false);
+  m_virtual_keys_toggle = !is_enabled("disable-virtual-keys-toggle");
+  apply_stage_directives();
+}
+
+void ServerState::apply_stage_directives() {
+  for (const auto& stage : m_stage->stages())
+    stage->set_virtual_keys_toggle(m_virtual_keys_toggle);
 }
 
 void ServerState::on_active_contexts_message(
@@ -152,6 +161,10 @@ bool ServerState::has_mouse_mappings() const {
   return m_stage->has_mouse_mappings();
 }
 
+bool ServerState::has_wheel_mappings() const {
+  return m_stage->has_wheel_mappings();
+}
+
 bool ServerState::has_device_filters() const {
   return m_stage->has_device_filters();
 }
@@ -178,8 +191,12 @@ void ServerState::set_virtual_key_state(Key key, KeyState state) {
   else {
     return;
   }
-  if (is_virtual_key(key))
+  if (is_virtual_key(key)) {
     m_client->send_virtual_key_state(key, state);
+    // while sending keys the messages are flushed afterwards
+    if (!m_sending_key)
+      flush_client_messages();
+  }
 }
 
 void ServerState::toggle_virtual_key(Key key) {
@@ -192,10 +209,14 @@ const DeviceDesc* ServerState::get_device_desc(int device_index) const {
       &m_device_descs[device_index] : nullptr);
 }
 
-bool ServerState::translate_input(KeyEvent input, int device_index) {
+bool ServerState::translate_input(KeyEvent input, int device_index,
+    std::optional<Clock::time_point> time) {
+  // prefer the time the event was generated over the time it was dequeued
+  const auto input_time = time.value_or(Clock::now());
+
   // ignore key repeat while a flush or a timeout is pending
-  if (input == m_last_key_event && 
-        (m_flush_scheduled_at || m_timeout_start_at)) {
+  if (input == m_last_key_event &&
+      (m_flush_scheduled_at || m_timeout_start_at)) {
     verbose_debug_io(input, { }, true);
     return true;
   }
@@ -224,9 +245,10 @@ bool ServerState::translate_input(KeyEvent input, int device_index) {
       (input.state == KeyState::Down || m_cancel_timeout_on_up)) {
     // cancel current time out, inject event with elapsed time
     const auto time_since_timeout_start = 
-      (Clock::now() - *m_timeout_start_at);
+      std::max(input_time - *m_timeout_start_at, Clock::duration::zero());
     cancel_timeout();
-    translate_input(make_input_timeout_event(time_since_timeout_start), device_index);
+    translate_input(make_input_timeout_event(time_since_timeout_start), 
+      device_index, input_time);
     cancelled_timeout = true;
   }
 
@@ -243,12 +265,13 @@ bool ServerState::translate_input(KeyEvent input, int device_index) {
 
   // automatically insert mouse wheel Down before Up
   if (is_mouse_wheel(input.key) && input.state == KeyState::Up)
-    translate_input({ input.key, KeyState::Down, input.value }, device_index);
+    translate_input({ input.key, KeyState::Down, input.value }, 
+      device_index, input_time);
 
   if (is_keyboard_key(input.key))
     m_last_key_event = input;
 
-  auto output = m_stage->update(input, device_index);
+  auto output = m_stage->update(input, device_index, input_time);
 
   if (m_stage->should_exit()) {
     verbose("Read exit sequence");
@@ -259,11 +282,13 @@ bool ServerState::translate_input(KeyEvent input, int device_index) {
 
   // waiting for input 
   const auto it = std::find_if(output.begin(), output.end(), 
-    [](const KeyEvent& event) { return event.key == Key::timeout; });
+    [](const KeyEvent& event) { 
+      return (event.key == Key::timeout && event.state != KeyState::OutputDelay); 
+    });
   if (it != output.end()) {
     schedule_timeout(
       timeout_to_milliseconds(it->value), 
-      cancel_timeout_on_up(it->state));
+      cancel_timeout_on_up(it->state), input_time);
     output.erase(it);
   }
 
@@ -305,10 +330,16 @@ bool is_control_up(const KeyEvent& event) {
           event.key == Key::ControlRight));
 }
 
-bool ServerState::flush_send_buffer() {
+bool ServerState::flush_send_buffer(std::optional<Clock::time_point> time) {
   if (m_sending_key)
     return true;
   m_sending_key = true;
+
+  // continue output delays from the time the flush was scheduled for, so
+  // the lateness of waking up does not accumulate
+  const auto now = time.value_or(Clock::now());
+  const auto scheduled_at = flush_scheduled_at();
+  const auto delay_from = (scheduled_at && *scheduled_at <= now ? *scheduled_at : now);
   m_flush_scheduled_at.reset();
 
   auto succeeded = true;
@@ -342,7 +373,7 @@ bool ServerState::flush_send_buffer() {
     }
 
     if (event.key == Key::timeout) {
-      schedule_flush(timeout_to_milliseconds(event.value));
+      schedule_flush_at(delay_from + timeout_to_milliseconds(event.value));
       ++i;
       break;
     }
@@ -365,26 +396,32 @@ bool ServerState::flush_send_buffer() {
   
   if (!on_flushed_send_buffer())
     succeeded = false;
+  flush_client_messages();
   m_send_buffer.erase(m_send_buffer.begin(), m_send_buffer.begin() + i);
   m_sending_key = false;
   return succeeded;
 }
 
 void ServerState::schedule_flush(Duration delay) {
+  schedule_flush_at(Clock::now() + 
+    std::chrono::duration_cast<Clock::duration>(delay));
+}
+
+void ServerState::schedule_flush_at(Clock::time_point deadline) {
   if (m_flush_scheduled_at)
     return;
-  m_flush_scheduled_at = Clock::now() + 
-    std::chrono::duration_cast<Clock::duration>(delay);
-  on_flush_scheduled(delay);
+  m_flush_scheduled_at = deadline;
+  on_flush_scheduled(std::max(deadline - Clock::now(), Clock::duration::zero()));
 }
 
 std::optional<Clock::time_point> ServerState::flush_scheduled_at() const {
   return m_flush_scheduled_at;
 }
 
-void ServerState::schedule_timeout(Duration timeout, bool cancel_on_up) {
+void ServerState::schedule_timeout(Duration timeout, bool cancel_on_up,
+    Clock::time_point start_at) {
   m_timeout = timeout;
-  m_timeout_start_at = Clock::now();
+  m_timeout_start_at = start_at;
   m_cancel_timeout_on_up = cancel_on_up;
   on_timeout_scheduled(timeout);
 }
@@ -402,3 +439,29 @@ void ServerState::cancel_timeout() {
   m_timeout = { };
   on_timeout_cancelled();
 }
+
+void ServerState::flush_client_messages() {
+  // never block on client, retry sending what it did not accept yet
+  m_client->flush_messages();
+  if (m_client->has_queued_messages()) {
+    m_client_messages_retry_at = Clock::now() +
+      std::chrono::duration_cast<Clock::duration>(client_messages_retry_interval);
+    on_client_messages_retry_scheduled(client_messages_retry_interval);
+  }
+  else
+    m_client_messages_retry_at.reset();
+}
+
+std::optional<Clock::time_point> ServerState::next_deadline() const {
+  auto deadline = m_client_messages_retry_at;
+  const auto set_deadline = [&](Clock::time_point time) {
+    if (!deadline || time < *deadline)
+      deadline = time;
+  };
+  if (m_flush_scheduled_at)
+    set_deadline(*m_flush_scheduled_at);
+  if (m_timeout_start_at)
+    set_deadline(*m_timeout_start_at +
+      std::chrono::duration_cast<Clock::duration>(m_timeout));
+  return deadline;
+}
@@ -16,22 +16,30 @@ public:
   bool has_configuration() const;
   bool has_active_client_context() const;
   bool has_mouse_mappings() const;
+  bool has_wheel_mappings() const;
   bool has_device_filters() const;
   void set_device_descs(std::vector<DeviceDesc> device_descs);
   bool should_exit() const;
-  bool translate_input(KeyEvent input, int device_index);
-  bool flush_send_buffer();
+  bool translate_input(KeyEvent input, int device_index,
+    std::optional<Clock::time_point> time = { });
+  bool flush_send_buffer(std::optional<Clock::time_point> time = { });
   bool sending_key() const { return m_sending_key; }
   const std::vector<StagePtr>& stages() const { return m_stage->stages(); }
   bool stage_is_clear() const { return m_stage->is_clear(); }
   void schedule_flush(Duration delay = { });
+  void schedule_flush_at(Clock::time_point deadline);
   std::optional<Clock::time_point> flush_scheduled_at() const;
   std::optional<Clock::time_point> timeout_start_at() const;
   Duration timeout() const;
   void cancel_timeout();
+  // sends queued messages to client without blocking
+  void flush_client_messages();
+  // earliest deadline of the pending flush, timeout and client messages
+  std::optional<Clock::time_point> next_deadline() const;
+  const std::vector<Key>& virtual_keys_down() const { return m_virtual_keys_down; }
 
 protected:
-  void on_configuration_message(std::unique_ptr<MultiStage> stage) override;
+  bool on_configuration_message(std::unique_ptr<MultiStage> stage) override;
   void on_directives_message(const std::vector<std::string>& directives) override;
   void on_active_contexts_message(
       const std::vector<int>& active_contexts) override;
@@ -46,6 +54,7 @@ protected:
   virtual void on_flush_scheduled(Duration timeout) { }
   virtual void on_timeout_scheduled(Duration timeout) { }
   virtual void on_timeout_cancelled() { }
+  virtual void on_client_messages_retry_scheduled(Duration delay) { }
   virtual void on_exit_requested() = 0;
   virtual bool on_validate_key_is_down(Key key) { return true; }
   virtual std::string get_devices_error_message() { return { }; }
@@ -53,10 +62,12 @@ protected:
   void release_all_keys();
   void set_active_contexts(const std::vector<int>& active_contexts);
   void send_key_sequence(const KeySequence& key_sequence);
-  void schedule_timeout(Duration timeout, bool cancel_on_up);
+  void schedule_timeout(Duration timeout, bool cancel_on_up,
+    Clock::time_point start_at);
   void set_virtual_key_state(Key key, KeyState state);
   void toggle_virtual_key(Key key);
   void evaluate_device_filters();
+  void apply_stage_directives();
   const DeviceDesc* get_device_desc(int device_index) const;
 
 private:
@@ -66,9 +77,12 @@ private:
   std::vector<Key> m_virtual_keys_down;
   KeyEvent m_last_key_event;
   bool m_sending_key{ };
+  bool m_virtual_keys_toggle{ true };
   int m_insert_in_send_buffer_at{ -1 };
   std::optional<Clock::time_point> m_flush_scheduled_at;
   std::optional<Clock::time_point> m_timeout_start_at;
+  std::optional<Clock::time_point> m_client_messages_retry_at;
+  static constexpr auto client_messages_retry_interval = std::chrono::milliseconds(5);
   Duration m_timeout{ };
   bool m_cancel_timeout_on_up{ };
   std::vector<DeviceDesc> m_device_descs;
@@ -1,6 +1,24 @@
 
 #include "Settings.h"
 #include "common/output.h"
+#include <cstdlib>
+#include <limits>
+
+#if defined(__linux__)
+# include <sched.h>
+
+namespace {
+  // accepts only a complete decimal number within the range
+  bool parse_number(const char* string, int min, int max, int* result) {
+    auto end = static_cast<char*>(nullptr);
+    const auto value = std::strtol(string, &end, 10);
+    if (end == string || *end != '\0' || value < min || value > max)
+      return false;
+    *result = static_cast<int>(value);
+    return true;
+  }
+} // namespace
+#endif
 
 #if defined(_WIN32)
 bool interpret_commandline(Settings& settings, int argc, wchar_t* argv[]) {
@@ -21,6 +39,58 @@ bool interpret_commandline(Settings& settings, int argc, char* argv[]) {
     else if (argument == T("-g")) {
       settings.grab_and_exit = true;
     }
+#endif
+#if defined(__linux__)
+    else if (argument == T("--realtime")) {
+      settings.realtime = true;
+    }
+    else if (argument == T("--round-robin")) {
+      settings.realtime = true;
+      settings.realtime_round_robin = true;
+    }
+    else if (argument == T("--priority")) {
+      if (++i >= argc)
+        return false;
+      settings.realtime = true;
+      if (!parse_number(argv[i], 1, 99, &settings.realtime_priority))
+        return false;
+    }
+    else if (argument == T("--cpu")) {
+      if (++i >= argc)
+        return false;
+      // pinning is applied when enabling real-time mode
+      settings.realtime = true;
+      if (!parse_number(argv[i], 0, CPU_SETSIZE - 1, &settings.realtime_cpu))
+        return false;
+    }
+    else if (argument == T("--forward-device-timeout")) {
+      if (++i >= argc)
+        return false;
+      if (!parse_number(argv[i], 0, std::numeric_limits<int>::max(),
+            &settings.forward_device_timeout))
+        return false;
+    }
+    else if (argument == T("--input-trace")) {
+      if (++i >= argc)
+        return false;
+      settings.input_trace = argv[i];
+    }
+    else if (argument == T("--output-trace")) {
+      if (++i >= argc)
+        return false;
+      settings.output_trace = argv[i];
+    }
+    else if (argument == T("--latency")) {
+      settings.measure_latency = true;
+    }
+    else if (argument == T("--handoff")) {
+      // passed internally when re-executing on SIGHUP
+      if (++i >= argc)
+        return false;
+      if (!parse_number(argv[i], 0, std::numeric_limits<int>::max(),
+            &settings.handoff_fd))
+        return false;
+    }
 #endif
     else {
       return false;
@@ -35,6 +105,19 @@ void print_help_message() {
     "\n"
     "Usage: keymapperd [-options]\n"
     "  -v, --verbose        enable verbose output.\n"
+#if defined(__linux__)
+    "  --realtime           use real-time scheduling and lock memory.\n"
+    "  --priority <1-99>    real-time priority (default 50).\n"
+    "  --round-robin        use round-robin instead of FIFO scheduling.\n"
+    "  --cpu <index>        pin to a CPU (implies --realtime).\n"
+    "  --forward-device-timeout <seconds>\n"
+    "                       keep virtual devices of disconnected devices\n"
+    "                       for reuse (default 300).\n"
+    "  --input-trace <file> read input events from file/FIFO instead of devices.\n"
+    "  --output-trace <file>\n"
+    "                       write output events to file/FIFO instead of uinput.\n"
+    "  --latency            measure latency, print on SIGUSR1 and at exit.\n"
+#endif
     "  -h, --help           print this help.\n"
     "\n"
     "%s\n"
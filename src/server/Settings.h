@@ -5,6 +5,15 @@
 struct Settings {
   bool verbose;
   bool grab_and_exit;
+  bool realtime;
+  bool realtime_round_robin;
+  int realtime_priority{ 50 };
+  int realtime_cpu{ -1 };
+  int forward_device_timeout{ 300 };
+  std::string input_trace;
+  std::string output_trace;
+  bool measure_latency;
+  int handoff_fd{ -1 };
 };
 
 #if defined(_WIN32)
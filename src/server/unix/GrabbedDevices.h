@@ -18,6 +18,8 @@ public:
     int type;
     int code;
     int value;
+    // time the event was generated (when provided by the system)
+    std::optional<std::chrono::steady_clock::time_point> time;
   };
 
   GrabbedDevices();
@@ -30,6 +32,20 @@ public:
   std::pair<bool, std::optional<Event>> read_input_event(
     std::optional<Duration> timeout, int interrupt_fd);
   const std::vector<DeviceDesc>& grabbed_device_descs() const;
+#if defined(__linux__)
+  struct Statistics {
+    // number of times the kernel dropped events of a device
+    int events_dropped;
+    // number of key events synthesized after events were dropped
+    int keys_resynced;
+  };
+
+  // releases ownership of the grabbed devices (event id, fd) without ungrabbing
+  std::vector<std::pair<int, int>> release_devices();
+  Statistics statistics() const;
+  // whether reading failed because all events of the input trace were read
+  bool end_of_input_trace() const;
+#endif
 
 private:
   std::unique_ptr<class GrabbedDevicesImpl> m_impl;
@@ -39,6 +55,14 @@ std::optional<KeyEvent> to_key_event(const GrabbedDevices::Event& event);
 
 #if defined(__linux__)
 extern bool linux_highres_wheel_events;
+// discard autorepeat events of grabbed devices
+extern bool linux_suppress_key_repeat;
+// merge consecutive wheel events which were already read
+extern bool linux_coalesce_wheel_events;
+// path of file to read input events from instead of the devices
+extern std::string linux_input_trace;
+// devices grabbed by the previous process (event id, fd), taken over on first grab
+extern std::vector<std::pair<int, int>> linux_handoff_grabbed_devices;
 #endif
 
 #if defined(__APPLE__)
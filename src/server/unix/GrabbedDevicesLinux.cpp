@@ -2,16 +2,22 @@
 #include "GrabbedDevices.h"
 #include "VirtualDevices.h"
 #include "DeviceDescLinux.h"
+#include "IoUringLinux.h"
+#include "HandoffLinux.h"
 #include "common/output.h"
 #include "common/Duration.h"
 #include <cstdio>
 #include <cerrno>
+#include <ctime>
 #include <array>
 #include <algorithm>
 #include <bitset>
 #include <iterator>
 #include <filesystem>
+#include <string>
+#include <utility>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 
 #if defined(__FreeBSD__)
@@ -26,6 +32,10 @@
 #endif
 
 bool linux_highres_wheel_events;
+bool linux_suppress_key_repeat;
+bool linux_coalesce_wheel_events;
+std::string linux_input_trace;
+std::vector<std::pair<int, int>> linux_handoff_grabbed_devices;
 
 namespace {
   struct IntRange {
@@ -35,6 +45,11 @@ namespace {
 
   constexpr auto default_abs_range = IntRange{ 0, 1023 };
 
+  // devices with keys which stay pressed are grabbed anyway after a while
+  constexpr auto pending_device_grab_timeout = std::chrono::seconds(5);
+
+  constexpr auto input_trace_event_id = -1;
+
   template<uint64_t Value> uint64_t bit = (1ull << Value);
 
   bool ends_with(std::string_view str, std::string_view end) {
@@ -252,18 +267,37 @@ namespace {
     return axes;
   }
 
+  using KeyBits = std::bitset<KEY_MAX + 1>;
+
+  std::optional<KeyBits> get_device_key_state(int fd) {
+    auto bits = std::array<unsigned char, (KEY_MAX + 7) / 8>();
+    if (ioctl(fd, EVIOCGKEY(bits.size()), bits.data()) == -1)
+      return std::nullopt;
+
+    auto key_state = KeyBits();
+    for (auto code = size_t{ }; code < key_state.size(); ++code)
+      if (bits[code / 8] & (1 << (code % 8)))
+        key_state.set(code);
+    return key_state;
+  }
+
+  std::optional<bool> are_keys_released(int fd) {
+    auto bits = std::array<char, (KEY_MAX + 7) / 8>();
+    if (ioctl(fd, EVIOCGKEY(bits.size()), bits.data()) == -1)
+      return std::nullopt;
+
+    return std::none_of(std::cbegin(bits), std::cend(bits),
+      [](char bits) { return (bits != 0); });
+  }
+
   bool wait_until_keys_released(int fd) {
     const auto retries = 1000;
     const auto sleep_ms = 5;
     for (auto i = 0; i < retries; ++i) {
-      auto bits = std::array<char, (KEY_MAX + 7) / 8>();
-      if (ioctl(fd, EVIOCGKEY(bits.size()), bits.data()) == -1)
+      const auto released = are_keys_released(fd);
+      if (!released.has_value())
         return false;
-
-      const auto all_keys_released =
-        std::none_of(std::cbegin(bits), std::cend(bits),
-          [](char bits) { return (bits != 0); });
-      if (all_keys_released)
+      if (released.value())
         return true;
 
       ::usleep(sleep_ms * 1000);
@@ -271,6 +305,35 @@ namespace {
     return false;
   }
 
+  // discards the events of a device which is not grabbed yet
+  bool skip_pending_events(int fd) {
+    auto events = std::array<input_event, 64>();
+    const auto ret = ::read(fd, events.data(), sizeof(events));
+    return (ret > 0 || (ret == -1 && errno == EINTR));
+  }
+
+  // discards the events which are queued in the kernel
+  void skip_queued_events(int fd) {
+    auto pfd = pollfd{ fd, POLLIN, 0 };
+    while (::poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN) &&
+           skip_pending_events(fd)) { }
+  }
+
+  bool set_monotonic_event_time(int fd) {
+#if defined(EVIOCSCLOCKID)
+    auto clock_id = int{ CLOCK_MONOTONIC };
+    return (ioctl(fd, EVIOCSCLOCKID, &clock_id) == 0);
+#else
+    return false;
+#endif
+  }
+
+  std::chrono::steady_clock::time_point to_time_point(const input_event& ev) {
+    using namespace std::chrono;
+    return steady_clock::time_point(duration_cast<steady_clock::duration>(
+      seconds(ev.input_event_sec) + microseconds(ev.input_event_usec)));
+  }
+
   bool grab_event_device(int fd, bool grab) {
     return (ioctl(fd, EVIOCGRAB, (grab ? 1 : 0)) == 0);
   }
@@ -289,7 +352,9 @@ namespace {
 #if defined(ENABLE_DEVICE_MONITOR)
     auto fd = ::inotify_init();
     if (fd >= 0) {
-      auto ret = ::inotify_add_watch(fd, "/dev/input", IN_CREATE | IN_DELETE);
+      // udev fixes the permissions after the device node was created
+      auto ret = ::inotify_add_watch(fd, "/dev/input",
+        IN_CREATE | IN_DELETE | IN_ATTRIB);
       if (ret == -1) {
         ::close(fd);
         fd = -1;
@@ -301,17 +366,24 @@ namespace {
 #endif
   }
 
-  bool read_all(int fd, char* buffer, size_t length) {
-    while (length != 0) {
-      auto ret = ::read(fd, buffer, length);
-      if (ret == -1 && errno == EINTR)
-        continue;
-      if (ret <= 0)
-        return false;
-      length -= static_cast<size_t>(ret);
-      buffer += ret;
-    }
-    return true;
+  // udev creates the links, which provide the device ids, after the device node
+  int add_device_id_watch(int monitor_fd) {
+#if defined(ENABLE_DEVICE_MONITOR)
+    return ::inotify_add_watch(monitor_fd, "/dev/input/by-id", IN_CREATE);
+#else
+    return -1;
+#endif
+  }
+
+  // returns the event id of the device a link in /dev/input/by-id points to
+  std::optional<int> get_device_id_event_id(const char* device_id) {
+    auto ec = std::error_code{ };
+    const auto target_path = std::filesystem::read_symlink(
+      std::filesystem::path("/dev/input/by-id") / device_id, ec);
+    auto event_id = 0;
+    if (ec || ::sscanf(target_path.c_str(), "../event%d", &event_id) != 1)
+      return std::nullopt;
+    return event_id;
   }
 } // namespace
 
@@ -325,16 +397,62 @@ private:
     IntRange abs_range_volume;
     IntRange abs_range_misc;
     bool has_highres_wheel;
-    bool disappeared;
+    DeviceDesc desc;
+    KeyBits down_keys;
+    bool events_dropped;
+    bool monotonic_event_time;
+  };
+
+  // devices which are grabbed as soon as all their keys are released
+  struct PendingDevice {
+    int event_id;
+    int fd;
+    DeviceDesc desc;
+    std::chrono::steady_clock::time_point grab_deadline;
   };
 
   std::string_view m_ignore_device_name;
   bool m_grab_mice{ };
   std::vector<GrabDeviceFilter> m_grab_filters;
   int m_device_monitor_fd{ -1 };
+  int m_device_id_watch{ -1 };
   std::vector<Device> m_grabbed_devices;
+  std::vector<PendingDevice> m_pending_devices;
   std::vector<DeviceDesc> m_grabbed_device_descs;
+  std::vector<std::pair<int, bool>> m_changed_event_ids;
+  bool m_rescan_devices{ };
+  bool m_pending_devices_grabbed{ };
+  std::vector<GrabbedDevices::Event> m_resync_events;
+  GrabbedDevices::Statistics m_statistics{ };
   bool m_devices_changed{ };
+  int m_device_list_version{ };
+  std::vector<std::pair<int, input_event>> m_read_events;
+  size_t m_read_events_pos{ };
+  // input trace is replayed at the pace it was recorded
+  std::optional<std::chrono::steady_clock::duration> m_trace_time_offset;
+  std::optional<std::chrono::steady_clock::time_point> m_trace_event_due;
+  // state of the recorded keys, like it is queried from a device
+  KeyBits m_trace_key_state;
+  bool m_end_of_input_trace{ };
+
+#if defined(ENABLE_IO_URING)
+  enum class RingRequestType { read_device, poll_monitor, poll_pending, poll_interrupt };
+
+  struct RingRequest {
+    RingRequestType type;
+    int fd;
+    int event_id;
+    bool cancelled;
+    bool failed;
+    std::array<input_event, 64> buffer;
+  };
+
+  IoUring m_ring;
+  bool m_ring_failed{ };
+  int m_ring_device_list_version{ -1 };
+  int m_ring_interrupt_fd{ -1 };
+  std::vector<std::unique_ptr<RingRequest>> m_ring_requests;
+#endif
 
 public:
   using Event = GrabbedDevices::Event;
@@ -346,36 +464,120 @@ public:
       for (const auto& device : m_grabbed_devices)
         ungrab_device(device);
     }
+    for (const auto& device : m_pending_devices)
+      ::close(device.fd);
     release_device_monitor();
+#if defined(ENABLE_IO_URING)
+    release_ring();
+#endif
   }
 
   bool initialize(bool grab_mice, std::vector<GrabDeviceFilter> grab_filters) {
     m_grab_mice = grab_mice;
     m_grab_filters = std::move(grab_filters);
+    if (!linux_input_trace.empty())
+      return open_input_trace();
     update();
+
+    // release devices of previous process which are no longer present
+    close_handoff_devices(linux_handoff_grabbed_devices);
     return true;
   }
 
+  std::vector<std::pair<int, int>> release_devices() {
+#if defined(ENABLE_IO_URING)
+    release_ring();
+#endif
+    auto devices = std::vector<std::pair<int, int>>();
+    for (const auto& device : m_grabbed_devices)
+      devices.emplace_back(device.event_id, device.fd);
+    m_grabbed_devices.clear();
+    update_grabbed_device_descs();
+    ++m_device_list_version;
+    return devices;
+  }
+
   bool update_devices() {
     if (!m_devices_changed)
       return false;
-
-    update();
     m_devices_changed = false;
-    return true;
+
+    // fall back to a full rescan when monitor events were lost
+    if (std::exchange(m_rescan_devices, false)) {
+      m_pending_devices_grabbed = false;
+      update();
+      return true;
+    }
+
+    // only process the device nodes which were added/removed
+    auto changed = std::exchange(m_pending_devices_grabbed, false);
+    for (auto [event_id, added] : std::exchange(m_changed_event_ids, { }))
+      changed |= (added ? update_device(event_id) : remove_device(event_id));
+
+    if (changed)
+      update_grabbed_device_descs();
+    return changed;
   }
 
   const std::vector<DeviceDesc>& grabbed_device_descs() const {
     return m_grabbed_device_descs;
   }
 
+  const GrabbedDevices::Statistics& statistics() const {
+    return m_statistics;
+  }
+
+  bool end_of_input_trace() const {
+    return m_end_of_input_trace;
+  }
+
   std::pair<bool, std::optional<Event>> read_input_event(
         std::optional<Duration> timeout, int interrupt_fd) {
+    if (!m_resync_events.empty()) {
+      const auto event = m_resync_events.front();
+      m_resync_events.erase(m_resync_events.begin());
+      return { true, event };
+    }
+
+    // return events which were already read
+    if (auto event = pop_read_event())
+      return { true, event };
+    if (!m_resync_events.empty())
+      return { true, std::nullopt };
+
+    // wake up to grab pending devices when their deadline elapsed
+    if (!m_pending_devices.empty()) {
+      const auto pending_timeout = get_pending_devices_timeout();
+      if (!timeout || pending_timeout < timeout.value())
+        timeout = pending_timeout;
+    }
+
+    // wake up when the next event of the input trace is due
+    if (m_trace_event_due) {
+      const auto trace_timeout = std::max(Duration(m_trace_event_due.value() - 
+        std::chrono::steady_clock::now()), Duration::zero());
+      if (!timeout || trace_timeout < timeout.value())
+        timeout = trace_timeout;
+    }
+
+#if defined(ENABLE_IO_URING)
+    // the input trace is read using select, so it can be paced
+    if (!m_ring_failed && linux_input_trace.empty()) {
+      if (m_ring.initialized() || initialize_ring())
+        return read_input_event_ring(timeout, interrupt_fd);
+      verbose("Initializing io_uring failed, falling back to select");
+      m_ring_failed = true;
+    }
+#endif
+
     for (;;) {
       auto read_set = fd_set{ };
       FD_ZERO(&read_set);
       auto max_fd = 0;
       for (const auto& device : m_grabbed_devices) {
+        // do not read ahead while the next event of the trace is not due
+        if (is_input_trace(device) && m_trace_event_due)
+          continue;
         max_fd = std::max(max_fd, device.fd);
         FD_SET(device.fd, &read_set);
       }
@@ -385,6 +587,11 @@ public:
         FD_SET(m_device_monitor_fd, &read_set);
       }
 
+      for (const auto& device : m_pending_devices) {
+        max_fd = std::max(max_fd, device.fd);
+        FD_SET(device.fd, &read_set);
+      }
+
       if (interrupt_fd >= 0) {
         max_fd = std::max(max_fd, interrupt_fd);
         FD_SET(interrupt_fd, &read_set);
@@ -393,15 +600,16 @@ public:
       auto timeoutval = (timeout ? to_timeval(timeout.value()) : timeval{ });
       const auto result = ::select(max_fd + 1, &read_set,
         nullptr, nullptr, (timeout ? &timeoutval : nullptr));
+      // let caller handle signals
       if (result == -1 && errno == EINTR)
-        continue;
+        return { true, std::nullopt };
 
       if (result < 0)
         return { false, std::nullopt };
 
       if (m_device_monitor_fd >= 0 &&
           FD_ISSET(m_device_monitor_fd, &read_set)) {
-        m_devices_changed = true;
+        read_device_monitor();
         return { true, std::nullopt };
       }
 
@@ -409,46 +617,34 @@ public:
           FD_ISSET(interrupt_fd, &read_set))
         return { true, std::nullopt };
 
-      auto device_index = 0;
-      for (const auto& device : m_grabbed_devices) {
+      if (update_pending_devices(read_set)) {
+        m_devices_changed = true;
+        return { true, std::nullopt };
+      }
+
+      for (auto& device : m_grabbed_devices) {
         if (FD_ISSET(device.fd, &read_set)) {
-          auto ev = input_event{ };
-          if (!read_all(device.fd,
-                reinterpret_cast<char*>(&ev), sizeof(input_event)))
+          auto buffer = std::array<input_event, 64>{ };
+          const auto result = ::read(device.fd, buffer.data(), sizeof(buffer));
+          if (result == -1 && (errno == EINTR || errno == EAGAIN))
+            return { true, std::nullopt };
+          if (result == 0 && is_input_trace(device))
+            m_end_of_input_trace = true;
+          if (result <= 0)
             return { false, std::nullopt };
-
-          if (ev.type == EV_ABS) {
-            // map from device range to default range
-            if (ev.code == ABS_VOLUME) {
-              ev.value = map_to_range(ev.value, device.abs_range_volume, default_abs_range);
-            }
-            else if (ev.code == ABS_MISC) {
-              ev.value = map_to_range(ev.value, device.abs_range_misc, default_abs_range);
+          const auto count = static_cast<size_t>(result) / sizeof(input_event);
+          if (const auto rest = static_cast<size_t>(result) % sizeof(input_event)) {
+            // an incomplete event of the trace is read again by itself
+            if (!count || ::lseek(device.fd, -static_cast<off_t>(rest), SEEK_CUR) < 0) {
+              error("Input trace '%s' ends with an incomplete event",
+                linux_input_trace.c_str());
+              return { false, std::nullopt };
             }
           }
-          else if (ev.type == EV_REL) {
-            if (!device.has_highres_wheel ||
-                !linux_highres_wheel_events) {
-              // convert from low- to highres wheel event (when device does not send these)
-              if (ev.code == REL_WHEEL) {
-                ev.code = REL_WHEEL_HI_RES;
-                ev.value *= 120;
-              }
-              else if (ev.code == REL_HWHEEL) {
-                ev.code = REL_HWHEEL_HI_RES;
-                ev.value *= 120;
-              }
-              else if (ev.code == REL_WHEEL_HI_RES ||
-                       ev.code == REL_HWHEEL_HI_RES) {
-                // ignore highres events when they were not enabled by directive
-                continue;
-              }
-            }
-          }
-          
-          return { true, Event{ device_index, ev.type, ev.code, ev.value } };
+          for (auto i = size_t{ }; i < count; ++i)
+            m_read_events.emplace_back(device.event_id, buffer[i]);
+          return { true, pop_read_event() };
         }
-        ++device_index;
       }
       
       // timeout
@@ -457,21 +653,503 @@ public:
   }
 
 private:
+#if defined(ENABLE_IO_URING)
+  bool initialize_ring() {
+    return m_ring.initialize(256);
+  }
+
+  void release_ring() {
+    if (!m_ring.initialized())
+      return;
+
+    // wait until the kernel no longer references the request buffers
+    cancel_ring_requests();
+    for (auto i = 0; i < 10 && !m_ring_requests.empty(); ++i) {
+      if (!m_ring.wait(std::chrono::milliseconds(10)))
+        break;
+      while (auto completion = m_ring.pop_completion())
+        erase_ring_request(completion->user_data);
+    }
+    m_ring.release();
+    m_ring_requests.clear();
+  }
+
+  RingRequest* find_ring_request(uint64_t user_data) {
+    const auto it = std::find_if(m_ring_requests.begin(), m_ring_requests.end(),
+      [&](const auto& request) { 
+        return (reinterpret_cast<uint64_t>(request.get()) == user_data);
+      });
+    return (it != m_ring_requests.end() ? it->get() : nullptr);
+  }
+
+  void erase_ring_request(uint64_t user_data) {
+    m_ring_requests.erase(std::remove_if(
+      m_ring_requests.begin(), m_ring_requests.end(),
+      [&](const auto& request) {
+        return (reinterpret_cast<uint64_t>(request.get()) == user_data);
+      }), m_ring_requests.end());
+  }
+
+  void cancel_ring_requests() {
+    // failed requests are no longer in flight
+    m_ring_requests.erase(std::remove_if(
+      m_ring_requests.begin(), m_ring_requests.end(),
+      [](const auto& request) { return request->failed; }),
+      m_ring_requests.end());
+
+    for (auto& request : m_ring_requests)
+      if (!std::exchange(request->cancelled, true))
+        m_ring.submit_cancel(reinterpret_cast<uint64_t>(request.get()));
+  }
+
+  bool submit_ring_request(RingRequest& request) {
+    const auto user_data = reinterpret_cast<uint64_t>(&request);
+    if (request.type == RingRequestType::read_device)
+      return m_ring.submit_read(request.fd, request.buffer.data(),
+        sizeof(request.buffer), user_data);
+    return m_ring.submit_poll(request.fd, user_data);
+  }
+
+  void add_ring_request(RingRequestType type, int fd, int event_id = -1) {
+    const auto has_request = std::any_of(m_ring_requests.begin(), m_ring_requests.end(),
+      [&](const auto& request) { 
+        return (!request->cancelled && request->type == type && request->fd == fd);
+      });
+    if (has_request)
+      return;
+
+    auto& request = m_ring_requests.emplace_back(std::make_unique<RingRequest>());
+    request->type = type;
+    request->fd = fd;
+    request->event_id = event_id;
+    if (!submit_ring_request(*request))
+      m_ring_requests.pop_back();
+  }
+
+  void update_ring_requests(int interrupt_fd) {
+    // restart all requests when the file descriptors changed
+    if (m_device_list_version != m_ring_device_list_version ||
+        interrupt_fd != m_ring_interrupt_fd) {
+      cancel_ring_requests();
+      m_ring_device_list_version = m_device_list_version;
+      m_ring_interrupt_fd = interrupt_fd;
+    }
+
+    // (re)add requests which completed
+    for (const auto& device : m_grabbed_devices)
+      add_ring_request(RingRequestType::read_device, device.fd, device.event_id);
+    for (const auto& device : m_pending_devices)
+      add_ring_request(RingRequestType::poll_pending, device.fd);
+    if (m_device_monitor_fd >= 0)
+      add_ring_request(RingRequestType::poll_monitor, m_device_monitor_fd);
+    if (interrupt_fd >= 0)
+      add_ring_request(RingRequestType::poll_interrupt, interrupt_fd);
+  }
+
+  std::pair<bool, std::optional<Event>> read_input_event_ring(
+      std::optional<Duration> timeout, int interrupt_fd) {
+    for (;;) {
+      // return events which were already read
+      if (auto event = pop_read_event())
+        return { true, event };
+      if (!m_resync_events.empty())
+        return { true, std::nullopt };
+
+      update_ring_requests(interrupt_fd);
+      if (!m_ring.wait(timeout))
+        return { false, std::nullopt };
+
+      auto interrupted = false;
+      auto end_of_input = false;
+      auto pending_set = fd_set{ };
+      FD_ZERO(&pending_set);
+      while (const auto completion = m_ring.pop_completion()) {
+        const auto request = find_ring_request(completion->user_data);
+        if (!request)
+          continue;
+
+        auto restart = false;
+        switch (request->type) {
+          case RingRequestType::read_device:
+            if (completion->result > 0) {
+              // events of cancelled requests are still valid
+              const auto count = static_cast<size_t>(completion->result) / sizeof(input_event);
+              for (auto i = size_t{ }; i < count; ++i)
+                m_read_events.emplace_back(request->event_id, request->buffer[i]);
+              restart = true;
+            }
+            else if (completion->result == -EINTR || 
+                     completion->result == -EAGAIN) {
+              restart = true;
+            }
+            else if (!request->cancelled) {
+              // keep until device is removed, so it is not restarted
+              if (completion->result == 0)
+                end_of_input = true;
+              else
+                verbose("Reading /dev/input/event%d failed", request->event_id);
+              request->failed = true;
+              continue;
+            }
+            break;
+
+          case RingRequestType::poll_monitor:
+            if (!request->cancelled)
+              read_device_monitor();
+            interrupted = true;
+            break;
+
+          case RingRequestType::poll_pending:
+            if (!request->cancelled)
+              FD_SET(request->fd, &pending_set);
+            break;
+
+          case RingRequestType::poll_interrupt:
+            interrupted = true;
+            break;
+        }
+
+        if (restart && !request->cancelled && submit_ring_request(*request))
+          continue;
+        erase_ring_request(completion->user_data);
+      }
+
+      if (update_pending_devices(pending_set)) {
+        m_devices_changed = true;
+        return { true, std::nullopt };
+      }
+
+      if (end_of_input && m_read_events.empty())
+        return { false, std::nullopt };
+
+      if (interrupted)
+        return { true, std::nullopt };
+
+      if (m_read_events.empty())
+        return { true, std::nullopt };
+    }
+  }
+#endif // ENABLE_IO_URING
+
+  static bool is_input_trace(const Device& device) {
+    return (device.event_id == input_trace_event_id);
+  }
+
+  // maps the time recorded in the input trace to the time of replaying
+  std::chrono::steady_clock::time_point get_trace_event_time(const input_event& ev) {
+    const auto recorded_at = to_time_point(ev);
+    if (!m_trace_time_offset)
+      m_trace_time_offset = std::chrono::steady_clock::now() - recorded_at;
+    return recorded_at + m_trace_time_offset.value();
+  }
+
+  std::optional<Event> pop_read_event() {
+    m_trace_event_due.reset();
+    while (m_read_events_pos < m_read_events.size()) {
+      const auto [event_id, ev] = m_read_events[m_read_events_pos];
+      const auto device = find_device(event_id);
+      if (!device) {
+        ++m_read_events_pos;
+        continue;
+      }
+
+      auto event_time = std::optional<std::chrono::steady_clock::time_point>();
+      if (is_input_trace(*device)) {
+        event_time = get_trace_event_time(ev);
+        if (event_time.value() > std::chrono::steady_clock::now()) {
+          m_trace_event_due = event_time;
+          return std::nullopt;
+        }
+        update_trace_key_state(ev);
+      }
+      ++m_read_events_pos;
+
+      const auto device_index = static_cast<int>(
+        std::distance(m_grabbed_devices.data(), device));
+      if (auto event = translate_device_event(*device, device_index, ev)) {
+        if (event_time)
+          event->time = event_time;
+        if (linux_coalesce_wheel_events && is_highres_wheel_event(*event))
+          coalesce_wheel_events(*device, device_index, *event);
+        return event;
+      }
+      if (!m_resync_events.empty())
+        return std::nullopt;
+    }
+    m_read_events.clear();
+    m_read_events_pos = 0;
+    return std::nullopt;
+  }
+
+  static bool is_highres_wheel_event(const Event& event) {
+    return (event.type == EV_REL &&
+      (event.code == REL_WHEEL_HI_RES || event.code == REL_HWHEEL_HI_RES));
+  }
+
+  // merge the following wheel events of the same device and direction
+  // which were already read, the lowres events and reports in between
+  // would be ignored anyway
+  void coalesce_wheel_events(Device& device, int device_index, Event& event) {
+    const auto max_value = (1 << KeyEvent::value_bits) - 1;
+    for (auto pos = m_read_events_pos; pos < m_read_events.size(); ++pos) {
+      const auto [event_id, ev] = m_read_events[pos];
+      if (event_id != device.event_id)
+        break;
+      if (ev.type == EV_SYN && ev.code == SYN_REPORT)
+        continue;
+      if (ev.type != EV_REL)
+        break;
+      const auto next = translate_device_event(device, device_index, ev);
+      if (!next || next->code == REL_WHEEL || next->code == REL_HWHEEL)
+        continue;
+      if (next->code != event.code ||
+          (next->value < 0) != (event.value < 0) ||
+          std::abs(event.value + next->value) > max_value)
+        break;
+      event.value += next->value;
+      m_read_events_pos = pos + 1;
+    }
+  }
+
+  std::optional<Event> translate_device_event(Device& device, 
+      int device_index, input_event ev) {
+    if (ev.type == EV_SYN && ev.code == SYN_DROPPED) {
+      ++m_statistics.events_dropped;
+      error("Input events of /dev/input/event%d were dropped (%d times)",
+        device.event_id, m_statistics.events_dropped);
+      device.events_dropped = true;
+      return std::nullopt;
+    }
+
+    if (device.events_dropped) {
+      // discard events up to the next report, then resync key state
+      if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+        device.events_dropped = false;
+        resync_key_state(device, device_index);
+      }
+      return std::nullopt;
+    }
+
+    if (ev.type == EV_KEY) {
+      // virtual keyboard generates the autorepeat of the output
+      if (ev.value == 2 && linux_suppress_key_repeat)
+        return std::nullopt;
+      if (ev.code < device.down_keys.size())
+        device.down_keys.set(ev.code, ev.value != 0);
+    }
+    else if (ev.type == EV_ABS) {
+      // map from device range to default range
+      if (ev.code == ABS_VOLUME) {
+        ev.value = map_to_range(ev.value, device.abs_range_volume, default_abs_range);
+      }
+      else if (ev.code == ABS_MISC) {
+        ev.value = map_to_range(ev.value, device.abs_range_misc, default_abs_range);
+      }
+    }
+    else if (ev.type == EV_REL) {
+      if (!device.has_highres_wheel ||
+          !linux_highres_wheel_events) {
+        // convert from low- to highres wheel event (when device does not send these)
+        if (ev.code == REL_WHEEL) {
+          ev.code = REL_WHEEL_HI_RES;
+          ev.value *= 120;
+        }
+        else if (ev.code == REL_HWHEEL) {
+          ev.code = REL_HWHEEL_HI_RES;
+          ev.value *= 120;
+        }
+        else if (ev.code == REL_WHEEL_HI_RES ||
+                 ev.code == REL_HWHEEL_HI_RES) {
+          // ignore highres events when they were not enabled by directive
+          return std::nullopt;
+        }
+      }
+    }
+    auto event = Event{ device_index, ev.type, ev.code, ev.value };
+    if (device.monotonic_event_time)
+      event.time = to_time_point(ev);
+    return event;
+  }
+
+  void update_trace_key_state(const input_event& ev) {
+    if (ev.type == EV_KEY && ev.code < m_trace_key_state.size())
+      m_trace_key_state.set(ev.code, ev.value != 0);
+  }
+
+  // discards the events of a device which were not processed yet,
+  // the key state which is queried afterwards already contains them
+  void discard_queued_events(Device& device) {
+    const auto now = std::chrono::steady_clock::now();
+    auto it = m_read_events.begin() + 
+      static_cast<std::ptrdiff_t>(m_read_events_pos);
+    while (it != m_read_events.end()) {
+      const auto [event_id, ev] = *it;
+      if (event_id != device.event_id) {
+        ++it;
+        continue;
+      }
+      if (is_input_trace(device)) {
+        // the events of the trace which were recorded until now
+        if (get_trace_event_time(ev) > now)
+          break;
+        update_trace_key_state(ev);
+      }
+      it = m_read_events.erase(it);
+    }
+    if (!is_input_trace(device))
+      skip_queued_events(device.fd);
+  }
+
+  void resync_key_state(Device& device, int device_index) {
+    // like libevdev, drain the queue before querying the state,
+    // otherwise the queued events would be applied twice
+    discard_queued_events(device);
+    const auto key_state = (is_input_trace(device) ? 
+      std::make_optional(m_trace_key_state) : 
+      get_device_key_state(device.fd));
+    if (!key_state.has_value())
+      return;
+
+    // synthesize the events which were lost
+    const auto changed = (device.down_keys ^ key_state.value());
+    for (auto code = size_t{ }; code < changed.size(); ++code)
+      if (changed.test(code))
+        m_resync_events.push_back(Event{ device_index, EV_KEY, 
+          static_cast<int>(code), (key_state->test(code) ? 1 : 0) });
+    device.down_keys = key_state.value();
+    m_statistics.keys_resynced += static_cast<int>(changed.count());
+
+    verbose("Resynchronized key state of /dev/input/event%d (%d changes)",
+      device.event_id, static_cast<int>(changed.count()));
+  }
+
+  bool open_input_trace() {
+    // read input_event records like from an event device
+    const auto fd = open_event_device(linux_input_trace.c_str());
+    if (fd < 0) {
+      error("Opening input trace '%s' failed", linux_input_trace.c_str());
+      return false;
+    }
+    verbose("Reading input events from '%s'", linux_input_trace.c_str());
+    m_grabbed_devices.push_back({
+      input_trace_event_id,
+      fd,
+      default_abs_range,
+      default_abs_range,
+      false,
+      DeviceDesc{ "input trace" },
+      KeyBits(),
+      false,
+      false,
+    });
+    ++m_device_list_version;
+    update_grabbed_device_descs();
+    return true;
+  }
+
   void initialize_device_monitor() {
     release_device_monitor();
     m_device_monitor_fd = create_event_device_monitor();
+    m_device_id_watch = (m_device_monitor_fd >= 0 ? 
+      add_device_id_watch(m_device_monitor_fd) : -1);
+    ++m_device_list_version;
   }
 
   void release_device_monitor() {
     if (m_device_monitor_fd >= 0) {
       ::close(m_device_monitor_fd);
       m_device_monitor_fd = -1;
+      m_device_id_watch = -1;
     }
   }
-  
-  bool grab_device(int event_id, int fd) {
-    wait_until_keys_released(fd);
-    if (!grab_event_device(fd, true))
+
+  void read_device_monitor() {
+#if defined(ENABLE_DEVICE_MONITOR)
+    alignas(inotify_event) char buffer[4096];
+    const auto length = ::read(m_device_monitor_fd, buffer, sizeof(buffer));
+    if (length < 0 && errno == EINTR)
+      return;
+    if (length <= 0) {
+      m_rescan_devices = true;
+      m_devices_changed = true;
+      return;
+    }
+
+    for (auto pos = ssize_t{ }; pos < length; ) {
+      const auto& event = *reinterpret_cast<const inotify_event*>(&buffer[pos]);
+      pos += static_cast<ssize_t>(sizeof(inotify_event) + event.len);
+
+      auto event_id = 0;
+      if (event.mask & IN_Q_OVERFLOW) {
+        m_rescan_devices = true;
+        m_devices_changed = true;
+      }
+      else if (event.wd == m_device_id_watch) {
+        // a device id became available, the device is evaluated again
+        if (event.len)
+          if (const auto id_event_id = get_device_id_event_id(event.name)) {
+            m_changed_event_ids.emplace_back(*id_event_id, true);
+            m_devices_changed = true;
+          }
+      }
+      else if (event.len && m_device_id_watch < 0 &&
+          (event.mask & IN_CREATE) && (event.mask & IN_ISDIR) &&
+          event.name == std::string_view("by-id")) {
+        // directory did not exist yet, the links created before
+        // watching it are obtained by a rescan
+        m_device_id_watch = add_device_id_watch(m_device_monitor_fd);
+        m_rescan_devices = true;
+        m_devices_changed = true;
+      }
+      else if (event.len &&
+          ::sscanf(event.name, "event%d", &event_id) == 1) {
+        m_changed_event_ids.emplace_back(event_id, (event.mask & IN_CREATE) != 0);
+        m_devices_changed = true;
+      }
+    }
+#endif
+  }
+
+  Device* find_device(int event_id) {
+    const auto it = std::find_if(m_grabbed_devices.begin(), m_grabbed_devices.end(),
+      [&](const Device& device) { return device.event_id == event_id; });
+    return (it != m_grabbed_devices.end() ? &*it : nullptr);
+  }
+
+  DeviceDesc get_device_desc(int fd, int event_id, 
+      std::string device_name, std::string device_id) {
+    auto device_desc = DeviceDesc{ std::move(device_name), std::move(device_id) };
+
+    // obtain full descs of devices for which to create forward devices
+    if (has_mouse_axes(fd) ||
+        has_uncommon_abs_axes(fd)) {
+      auto ext = DeviceDescLinux{ };
+      ext.event_id = event_id;
+      const auto ids = get_device_ids(fd);
+      ext.vendor_id = ids.vendor;
+      ext.product_id = ids.product;
+      ext.version_id = ids.version;
+      ext.keys = get_device_keys(fd);
+      ext.rel_axes = get_device_rel_axes(fd);
+      ext.abs_axes = get_device_abs_axes(fd);
+      ext.rep_events = get_device_rep_events(fd);
+      ext.switch_events = get_device_switch_events(fd);
+      ext.misc_events = get_device_misc_events(fd);
+      ext.properties = get_device_properties(fd);
+      device_desc.ext = std::make_shared<DeviceDescLinux>(std::move(ext));
+    }
+    return device_desc;
+  }
+
+  PendingDevice* find_pending_device(int event_id) {
+    const auto it = std::find_if(m_pending_devices.begin(), m_pending_devices.end(),
+      [&](const PendingDevice& device) { return device.event_id == event_id; });
+    return (it != m_pending_devices.end() ? &*it : nullptr);
+  }
+
+  bool grab_device(int event_id, int fd, DeviceDesc device_desc,
+      bool already_grabbed = false) {
+    if (!already_grabbed && !grab_event_device(fd, true))
       return false;
 
     m_grabbed_devices.push_back({
@@ -480,7 +1158,12 @@ private:
       get_device_abs_axis_range(fd, ABS_VOLUME),
       get_device_abs_axis_range(fd, ABS_MISC),
       has_highres_wheel(fd),
+      std::move(device_desc),
+      get_device_key_state(fd).value_or(KeyBits()),
+      false,
+      set_monotonic_event_time(fd),
     });
+    ++m_device_list_version;
     return true;
   }
 
@@ -490,17 +1173,177 @@ private:
     ::close(device.fd);
   }
 
+  // returns true when the device was grabbed
+  bool add_device(int event_id) {
+    const auto path = "/dev/input/event" + std::to_string(event_id);
+    if (find_device(event_id) || find_pending_device(event_id)) {
+      verbose("  %s already grabbed", path.c_str());
+      return false;
+    }
+
+    // take over device which was grabbed by previous process
+    const auto handoff_fd = take_handoff_device(
+      linux_handoff_grabbed_devices, event_id);
+    const auto fd = (handoff_fd >= 0 ? handoff_fd : open_event_device(path.c_str()));
+    if (fd < 0) {
+      verbose("  %s opening failed", path.c_str());
+      return false;
+    }
+
+    auto device_name = get_device_name(fd);
+    auto status = "ignored";
+    auto grabbed = false;
+    if (is_supported_device(fd) &&
+        !is_virtual_device(device_name)) {
+      status = "skipped";
+      auto device_id = get_device_input_id(event_id);
+      if (evaluate_grab_filters(m_grab_filters, device_name, device_id,
+            is_grabbed_by_default(fd, m_grab_mice))) {
+        auto device_desc = get_device_desc(fd, event_id, 
+          device_name, std::move(device_id));
+        if (handoff_fd >= 0) {
+          status = "grabbing failed";
+          if (grab_device(event_id, fd, std::move(device_desc), true)) {
+            status = "taken over";
+            grabbed = true;
+          }
+        }
+        else if (are_keys_released(fd) == false) {
+          // do not block until the keys are released, grab it later
+          status = "grabbing deferred";
+          m_pending_devices.push_back({ event_id, ::dup(fd), std::move(device_desc),
+            std::chrono::steady_clock::now() + pending_device_grab_timeout });
+          ++m_device_list_version;
+        }
+        else {
+          status = "grabbing failed";
+          if (grab_device(event_id, fd, std::move(device_desc))) {
+            status = "grabbed";
+            grabbed = true;
+          }
+        }
+      }
+    }
+    if (handoff_fd >= 0 && !grabbed)
+      grab_event_device(fd, false);
+    ::close(fd);
+    verbose("  %s %s (%s)", path.c_str(), status, device_name.c_str());
+    return grabbed;
+  }
+
+  // evaluates a new device or one whose id or permissions changed,
+  // udev might not have been done with it when it was added.
+  // returns true when a device was grabbed or ungrabbed
+  bool update_device(int event_id) {
+    const auto device = find_device(event_id);
+    const auto pending = find_pending_device(event_id);
+    if (!device && !pending)
+      return add_device(event_id);
+
+    const auto& device_id = (device ? device->desc.id : pending->desc.id);
+    if (device_id == get_device_input_id(event_id))
+      return false;
+
+    verbose("  /dev/input/event%d id changed", event_id);
+    const auto removed = remove_device(event_id);
+    return (add_device(event_id) || removed);
+  }
+
+  // returns true when a grabbed device was removed
+  bool remove_device(int event_id) {
+    if (const auto pending = find_pending_device(event_id)) {
+      ::close(pending->fd);
+      m_pending_devices.erase(m_pending_devices.begin() + 
+        std::distance(m_pending_devices.data(), pending));
+      ++m_device_list_version;
+    }
+
+    const auto device = find_device(event_id);
+    if (!device)
+      return false;
+    ungrab_device(*device);
+    verbose("  /dev/input/event%d ungrabbed", event_id);
+
+    // keep resync events of other devices, the following indices shift
+    const auto device_index = static_cast<int>(
+      std::distance(m_grabbed_devices.data(), device));
+    m_resync_events.erase(std::remove_if(
+      m_resync_events.begin(), m_resync_events.end(),
+      [&](const Event& event) { return event.device_index == device_index; }),
+      m_resync_events.end());
+    for (auto& event : m_resync_events)
+      if (event.device_index > device_index)
+        --event.device_index;
+
+    m_grabbed_devices.erase(m_grabbed_devices.begin() + device_index);
+    ++m_device_list_version;
+    return true;
+  }
+
+  Duration get_pending_devices_timeout() const {
+    auto deadline = m_pending_devices.front().grab_deadline;
+    for (const auto& device : m_pending_devices)
+      deadline = std::min(deadline, device.grab_deadline);
+    return std::max(Duration(deadline - std::chrono::steady_clock::now()),
+      Duration::zero());
+  }
+
+  // returns true when a pending device was grabbed
+  bool update_pending_devices(const fd_set& read_set) {
+    const auto now = std::chrono::steady_clock::now();
+    auto grabbed = false;
+    for (auto it = m_pending_devices.begin(); it != m_pending_devices.end(); ) {
+      const auto expired = (now >= it->grab_deadline);
+      if (!expired && !FD_ISSET(it->fd, &read_set)) {
+        ++it;
+        continue;
+      }
+      const auto path = "/dev/input/event" + std::to_string(it->event_id);
+      if (FD_ISSET(it->fd, &read_set) && !skip_pending_events(it->fd)) {
+        verbose("  %s reading failed", path.c_str());
+        ::close(it->fd);
+        it = m_pending_devices.erase(it);
+        ++m_device_list_version;
+        continue;
+      }
+      // e.g. a key bit which is permanently set
+      const auto released = (expired ? std::optional<bool>(true) :
+        are_keys_released(it->fd));
+      if (released == true) {
+        const auto device_name = it->desc.name;
+        const auto grabbed_device = 
+          grab_device(it->event_id, it->fd, std::move(it->desc));
+        verbose("  %s %s (%s)", path.c_str(), 
+          (grabbed_device ? "grabbed" : "grabbing failed"), device_name.c_str());
+        grabbed |= grabbed_device;
+      }
+      if (released != false) {
+        ::close(it->fd);
+        it = m_pending_devices.erase(it);
+        ++m_device_list_version;
+        continue;
+      }
+      ++it;
+    }
+    m_pending_devices_grabbed |= grabbed;
+    return grabbed;
+  }
+
+  void update_grabbed_device_descs() {
+    m_grabbed_device_descs.clear();
+    for (const auto& device : m_grabbed_devices)
+      m_grabbed_device_descs.push_back(device.desc);
+  }
+
   void update() {
     verbose("Updating device list");
 
     // reset device monitor
     initialize_device_monitor();
-
-    // mark all devices as disappeared
-    for (auto& device : m_grabbed_devices)
-      device.disappeared = true;
+    m_changed_event_ids.clear();
 
     // grab new devices
+    auto present_event_ids = std::vector<int>();
     auto ec = std::error_code{ };
     for (auto const& entry : std::filesystem::directory_iterator("/dev/input", ec)) {
       const auto& path = entry.path();
@@ -509,75 +1352,25 @@ private:
           ::sscanf(path.c_str(), "/dev/input/event%d", &event_id) != 1)
         continue;
 
-      if (const auto fd = open_event_device(path.c_str()); fd >= 0) {
-        const auto device_name = get_device_name(fd);
-        const auto device_id = get_device_input_id(event_id);
-        auto status = "ignored";
-        if (is_supported_device(fd) &&
-            !is_virtual_device(device_name)) {
-          status = "skipped";
-          if (evaluate_grab_filters(m_grab_filters, device_name, device_id,
-                is_grabbed_by_default(fd, m_grab_mice))) {
-            const auto it = std::find_if(m_grabbed_devices.begin(), m_grabbed_devices.end(),
-              [&](const Device& device) { return device.event_id == event_id; });
-            if (it == m_grabbed_devices.end()) {
-              status = "grabbing failed";
-              if (grab_device(event_id, fd))
-                status = "grabbed";
-            }
-            else {
-              status = "already grabbed";
-              it->disappeared = false;
-            }
-          }
-        }
-        ::close(fd);
-        verbose("  %s %s (%s)", path.c_str(), status, device_name.c_str());
-      }
-      else {
-        verbose("  %s opening failed", path.c_str());
-      }
+      present_event_ids.push_back(event_id);
+      update_device(event_id);
     }
 
     // ungrab disappeared devices
-    for (auto it = m_grabbed_devices.begin(); it != m_grabbed_devices.end(); ) {
-      if (it->disappeared) {
-        ungrab_device(*it);
-        verbose("  /dev/input/event%d ungrabbed", it->event_id);
-        it = m_grabbed_devices.erase(it);
-      }
-      else {
-        ++it;
-      }
+    for (auto i = m_grabbed_devices.size(); i > 0; --i) {
+      const auto event_id = m_grabbed_devices[i - 1].event_id;
+      if (std::find(present_event_ids.begin(), present_event_ids.end(),
+            event_id) == present_event_ids.end())
+        remove_device(event_id);
     }
-
-    // collect grabbed device descs
-    m_grabbed_device_descs.clear();
-    for (const auto& device : m_grabbed_devices) {
-      auto& device_desc = m_grabbed_device_descs.emplace_back(DeviceDesc{
-        get_device_name(device.fd),
-        get_device_input_id(device.event_id),
-      });
-
-      // obtain full descs of devices for which to create forward devices
-      if (has_mouse_axes(device.fd) ||
-          has_uncommon_abs_axes(device.fd)) {
-        auto ext = DeviceDescLinux{ };
-        ext.event_id = device.event_id;
-        const auto ids = get_device_ids(device.fd);
-        ext.vendor_id = ids.vendor;
-        ext.product_id = ids.product;
-        ext.version_id = ids.version;
-        ext.keys = get_device_keys(device.fd);
-        ext.rel_axes = get_device_rel_axes(device.fd);
-        ext.abs_axes = get_device_abs_axes(device.fd);
-        ext.rep_events = get_device_rep_events(device.fd);
-        ext.switch_events = get_device_switch_events(device.fd);
-        ext.misc_events = get_device_misc_events(device.fd);
-        ext.properties = get_device_properties(device.fd);
-        device_desc.ext = std::make_shared<DeviceDescLinux>(std::move(ext));
-      }
+    for (auto i = m_pending_devices.size(); i > 0; --i) {
+      const auto event_id = m_pending_devices[i - 1].event_id;
+      if (std::find(present_event_ids.begin(), present_event_ids.end(),
+            event_id) == present_event_ids.end())
+        remove_device(event_id);
     }
+
+    update_grabbed_device_descs();
   }
 };
 
@@ -608,6 +1401,18 @@ const std::vector<DeviceDesc>& GrabbedDevices::grabbed_device_descs() const {
   return m_impl->grabbed_device_descs();
 }
 
+std::vector<std::pair<int, int>> GrabbedDevices::release_devices() {
+  return m_impl->release_devices();
+}
+
+GrabbedDevices::Statistics GrabbedDevices::statistics() const {
+  return m_impl->statistics();
+}
+
+bool GrabbedDevices::end_of_input_trace() const {
+  return m_impl->end_of_input_trace();
+}
+
 std::optional<KeyEvent> to_key_event(const GrabbedDevices::Event& event) {
   if (event.type == EV_KEY)
     return KeyEvent{
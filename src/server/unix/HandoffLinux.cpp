@@ -0,0 +1,135 @@
+
+#include "HandoffLinux.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+  enum class MessageType : int {
+    grabbed_device = 1,
+    virtual_device,
+    virtual_key_down,
+    end,
+  };
+
+  // one message per item, file descriptors are passed as ancillary data
+  struct Message {
+    MessageType type;
+    int event_id;
+    int key;
+  };
+
+  bool send_message(int socket_fd, const Message& message, int fd = -1) {
+    auto iov = iovec{ const_cast<Message*>(&message), sizeof(Message) };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{ };
+    auto header = msghdr{ };
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    if (fd >= 0) {
+      header.msg_control = control;
+      header.msg_controllen = sizeof(control);
+      const auto cmsg = CMSG_FIRSTHDR(&header);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    for (;;) {
+      const auto result = ::sendmsg(socket_fd, &header, MSG_NOSIGNAL);
+      if (result == -1 && errno == EINTR)
+        continue;
+      return (result == sizeof(Message));
+    }
+  }
+
+  bool receive_message(int socket_fd, Message& message, int& fd) {
+    auto iov = iovec{ &message, sizeof(Message) };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{ };
+    auto header = msghdr{ };
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    auto result = ssize_t{ };
+    do {
+      result = ::recvmsg(socket_fd, &header, MSG_CMSG_CLOEXEC);
+    } while (result == -1 && errno == EINTR);
+
+    fd = -1;
+    const auto cmsg = CMSG_FIRSTHDR(&header);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+      std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    if (result != sizeof(Message) || (header.msg_flags & MSG_CTRUNC)) {
+      if (fd >= 0)
+        ::close(fd);
+      return false;
+    }
+    return true;
+  }
+} // namespace
+
+bool send_handoff_state(int socket_fd, const HandoffState& state) {
+  for (const auto& [event_id, fd] : state.grabbed_devices)
+    if (!send_message(socket_fd, { MessageType::grabbed_device, event_id, 0 }, fd))
+      return false;
+  for (const auto& [event_id, fd] : state.virtual_devices)
+    if (!send_message(socket_fd, { MessageType::virtual_device, event_id, 0 }, fd))
+      return false;
+  for (const auto& key : state.virtual_keys_down)
+    if (!send_message(socket_fd, { MessageType::virtual_key_down, 0, *key }))
+      return false;
+  return send_message(socket_fd, { MessageType::end, 0, 0 });
+}
+
+bool receive_handoff_state(int socket_fd, HandoffState& state) {
+  for (;;) {
+    auto message = Message{ };
+    auto fd = -1;
+    if (!receive_message(socket_fd, message, fd))
+      return false;
+
+    switch (message.type) {
+      case MessageType::grabbed_device:
+      case MessageType::virtual_device:
+        if (fd < 0)
+          return false;
+        (message.type == MessageType::grabbed_device ?
+          state.grabbed_devices : state.virtual_devices).emplace_back(
+            message.event_id, fd);
+        break;
+
+      case MessageType::virtual_key_down:
+        state.virtual_keys_down.push_back(static_cast<Key>(message.key));
+        break;
+
+      case MessageType::end:
+        return true;
+
+      default:
+        if (fd >= 0)
+          ::close(fd);
+        return false;
+    }
+  }
+}
+
+void close_handoff_devices(std::vector<std::pair<int, int>>& devices) {
+  for (const auto& [event_id, fd] : devices)
+    ::close(fd);
+  devices.clear();
+}
+
+int take_handoff_device(std::vector<std::pair<int, int>>& devices, int event_id) {
+  const auto it = std::find_if(devices.begin(), devices.end(),
+    [&](const auto& device) { return device.first == event_id; });
+  if (it == devices.end())
+    return -1;
+  const auto fd = it->second;
+  devices.erase(it);
+  return fd;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "runtime/Key.h"
+#include <utility>
+#include <vector>
+
+// state passed to the re-executed keymapperd, so it can take over the
+// grabbed and virtual devices without releasing them
+struct HandoffState {
+  // event id and file descriptor, the virtual keyboard has event id -1
+  std::vector<std::pair<int, int>> grabbed_devices;
+  std::vector<std::pair<int, int>> virtual_devices;
+  std::vector<Key> virtual_keys_down;
+};
+
+bool send_handoff_state(int socket_fd, const HandoffState& state);
+bool receive_handoff_state(int socket_fd, HandoffState& state);
+void close_handoff_devices(std::vector<std::pair<int, int>>& devices);
+
+// returns -1 when no file descriptor was passed for event id
+int take_handoff_device(std::vector<std::pair<int, int>>& devices, int event_id);
@@ -0,0 +1,208 @@
+
+#include "IoUringLinux.h"
+
+#if defined(ENABLE_IO_URING)
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+  int io_uring_setup(unsigned int entries, io_uring_params* params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+  }
+
+  int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+      unsigned int flags, const void* arg, size_t arg_size) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+      min_complete, flags, arg, arg_size));
+  }
+
+  template<typename T>
+  T load_acquire(const T* value) {
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+  }
+
+  template<typename T>
+  void store_release(T* value, T new_value) {
+    __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+  }
+
+  void* map_ring(int fd, size_t size, off_t offset) {
+    const auto ring = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, offset);
+    return (ring != MAP_FAILED ? ring : nullptr);
+  }
+
+  template<typename T>
+  T* at_offset(void* base, unsigned int offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+  }
+} // namespace
+
+IoUring::~IoUring() {
+  release();
+}
+
+bool IoUring::initialize(unsigned int entries) {
+  release();
+
+  auto params = io_uring_params{ };
+  m_ring_fd = io_uring_setup(entries, &params);
+  if (m_ring_fd < 0)
+    return false;
+
+  // waiting with a timeout requires IORING_ENTER_EXT_ARG
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_EXT_ARG)) {
+    release();
+    return false;
+  }
+
+  m_ring_size = std::max(
+    params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+    params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  m_ring = map_ring(m_ring_fd, m_ring_size, IORING_OFF_SQ_RING);
+  m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  m_sqes = map_ring(m_ring_fd, m_sqes_size, IORING_OFF_SQES);
+  if (!m_ring || !m_sqes) {
+    release();
+    return false;
+  }
+
+  m_sq_entries = params.sq_entries;
+  m_sq_mask = *at_offset<unsigned int>(m_ring, params.sq_off.ring_mask);
+  m_sq_head = at_offset<unsigned int>(m_ring, params.sq_off.head);
+  m_sq_tail = at_offset<unsigned int>(m_ring, params.sq_off.tail);
+  m_sq_array = at_offset<unsigned int>(m_ring, params.sq_off.array);
+  m_sq_local_tail = *m_sq_tail;
+  m_cq_mask = *at_offset<unsigned int>(m_ring, params.cq_off.ring_mask);
+  m_cq_head = at_offset<unsigned int>(m_ring, params.cq_off.head);
+  m_cq_tail = at_offset<unsigned int>(m_ring, params.cq_off.tail);
+  m_cqes = at_offset<void>(m_ring, params.cq_off.cqes);
+  return true;
+}
+
+void IoUring::release() {
+  if (m_sqes)
+    ::munmap(m_sqes, m_sqes_size);
+  if (m_ring)
+    ::munmap(m_ring, m_ring_size);
+  if (m_ring_fd >= 0)
+    ::close(m_ring_fd);
+  m_ring_fd = -1;
+  m_ring = nullptr;
+  m_sqes = nullptr;
+}
+
+unsigned int IoUring::unsubmitted() const {
+  return m_sq_local_tail - load_acquire(m_sq_head);
+}
+
+io_uring_sqe* IoUring::next_sqe() {
+  if (!initialized())
+    return nullptr;
+
+  // submit queued requests when submission queue is full
+  if (unsubmitted() >= m_sq_entries) {
+    store_release(m_sq_tail, m_sq_local_tail);
+    if (io_uring_enter(m_ring_fd, unsubmitted(), 0, 0, nullptr, 0) < 0 ||
+        unsubmitted() >= m_sq_entries)
+      return nullptr;
+  }
+  const auto index = (m_sq_local_tail & m_sq_mask);
+  auto sqe = &static_cast<io_uring_sqe*>(m_sqes)[index];
+  std::memset(sqe, 0, sizeof(io_uring_sqe));
+  m_sq_array[index] = index;
+  ++m_sq_local_tail;
+  return sqe;
+}
+
+bool IoUring::submit_read(int fd, void* buffer, unsigned int size, uint64_t user_data) {
+  const auto sqe = next_sqe();
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buffer);
+  sqe->len = size;
+  sqe->off = static_cast<uint64_t>(-1);
+  sqe->user_data = user_data;
+  return true;
+}
+
+bool IoUring::submit_poll(int fd, uint64_t user_data) {
+  const auto sqe = next_sqe();
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = user_data;
+  return true;
+}
+
+bool IoUring::submit_cancel(uint64_t user_data_to_cancel) {
+  const auto sqe = next_sqe();
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = user_data_to_cancel;
+  // completion of cancel request itself is not of interest
+  sqe->user_data = 0;
+  return true;
+}
+
+bool IoUring::wait(std::optional<Duration> timeout) {
+  using namespace std::chrono;
+  if (!initialized())
+    return false;
+
+  auto ts = __kernel_timespec{ };
+  auto arg = io_uring_getevents_arg{ };
+  if (timeout) {
+    const auto duration = std::max(timeout.value(), Duration::zero());
+    const auto sec = duration_cast<seconds>(duration);
+    ts.tv_sec = sec.count();
+    ts.tv_nsec = duration_cast<nanoseconds>(duration - sec).count();
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+  }
+
+  store_release(m_sq_tail, m_sq_local_tail);
+  const auto result = io_uring_enter(m_ring_fd, unsubmitted(), 1,
+    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  return (result >= 0 || errno == ETIME || errno == EINTR);
+}
+
+auto IoUring::pop_completion() -> std::optional<Completion> {
+  if (!initialized())
+    return std::nullopt;
+
+  const auto head = *m_cq_head;
+  if (head == load_acquire(m_cq_tail))
+    return std::nullopt;
+
+  const auto& cqe = static_cast<const io_uring_cqe*>(m_cqes)[head & m_cq_mask];
+  const auto completion = Completion{ cqe.user_data, cqe.res };
+  store_release(m_cq_head, head + 1);
+  return completion;
+}
+
+#else // !ENABLE_IO_URING
+
+IoUring::~IoUring() = default;
+bool IoUring::initialize(unsigned int) { return false; }
+void IoUring::release() { }
+bool IoUring::submit_read(int, void*, unsigned int, uint64_t) { return false; }
+bool IoUring::submit_poll(int, uint64_t) { return false; }
+bool IoUring::submit_cancel(uint64_t) { return false; }
+bool IoUring::wait(std::optional<Duration>) { return false; }
+auto IoUring::pop_completion() -> std::optional<Completion> { return { }; }
+
+#endif // !ENABLE_IO_URING
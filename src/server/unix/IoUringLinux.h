@@ -0,0 +1,50 @@
+#pragma once
+
+#include "common/Duration.h"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// minimal io_uring wrapper, using the system calls directly
+class IoUring {
+public:
+  struct Completion {
+    uint64_t user_data;
+    int result;
+  };
+
+  IoUring() = default;
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+  ~IoUring();
+
+  bool initialize(unsigned int entries);
+  void release();
+  bool initialized() const { return (m_ring_fd >= 0); }
+  bool submit_read(int fd, void* buffer, unsigned int size, uint64_t user_data);
+  bool submit_poll(int fd, uint64_t user_data);
+  bool submit_cancel(uint64_t user_data_to_cancel);
+  // submits the queued requests and waits for at least one completion
+  bool wait(std::optional<Duration> timeout);
+  std::optional<Completion> pop_completion();
+
+private:
+  struct io_uring_sqe* next_sqe();
+  unsigned int unsubmitted() const;
+
+  int m_ring_fd{ -1 };
+  void* m_ring{ };
+  size_t m_ring_size{ };
+  void* m_sqes{ };
+  size_t m_sqes_size{ };
+  unsigned int m_sq_entries{ };
+  unsigned int m_sq_mask{ };
+  unsigned int m_sq_local_tail{ };
+  unsigned int* m_sq_head{ };
+  unsigned int* m_sq_tail{ };
+  unsigned int* m_sq_array{ };
+  unsigned int m_cq_mask{ };
+  unsigned int* m_cq_head{ };
+  unsigned int* m_cq_tail{ };
+  void* m_cqes{ };
+};
@@ -0,0 +1,53 @@
+
+#include "RealtimeLinux.h"
+#include "common/output.h"
+#include <cerrno>
+#include <sched.h>
+#include <sys/mman.h>
+
+namespace {
+  void prefault_stack() {
+    // touch the stack pages which the update loop might use
+    const auto stack_size = 256 * 1024;
+    char buffer[stack_size];
+    auto volatile* pages = buffer;
+    for (auto i = 0; i < stack_size; i += 4096)
+      pages[i] = 0;
+  }
+} // namespace
+
+bool set_realtime_scheduling(bool round_robin, int priority, int cpu) {
+  if (cpu >= 0) {
+    auto cpu_set = cpu_set_t{ };
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    if (::sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0)
+      error("Pinning to CPU %d failed", cpu);
+    else
+      verbose("Pinned to CPU %d", cpu);
+  }
+
+  const auto policy = (round_robin ? SCHED_RR : SCHED_FIFO);
+  auto param = sched_param{ };
+  param.sched_priority = priority;
+  if (::sched_setscheduler(0, policy, &param) != 0) {
+    error("Setting real-time scheduling failed (%s)",
+      (errno == EPERM ? "missing CAP_SYS_NICE" : "invalid priority"));
+    return false;
+  }
+  verbose("Set real-time scheduling %s with priority %d",
+    (policy == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO"), priority);
+  return true;
+}
+
+bool lock_memory() {
+  // lock after configuration was loaded, later allocations are locked on demand
+  if (::mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    error("Locking memory failed (%s)",
+      (errno == EPERM || errno == ENOMEM ? "missing CAP_IPC_LOCK" : "unknown error"));
+    return false;
+  }
+  verbose("Locked memory");
+  prefault_stack();
+  return true;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// requests real-time scheduling for the calling thread and pins it to
+// a CPU, when cpu is not negative. Returns false when it was not possible
+bool set_realtime_scheduling(bool round_robin, int priority, int cpu);
+
+// locks current and future memory and prefaults the stack
+bool lock_memory();
@@ -3,6 +3,9 @@
 #include "common/DeviceDesc.h"
 #include <vector>
 #include <memory>
+#include <utility>
+#include <chrono>
+#include <optional>
 
 struct KeyEvent;
 
@@ -22,11 +25,31 @@ public:
   bool send_key_event(const KeyEvent& event);
   bool forward_event(int device_index, int type, int code, int value);
   bool flush();
+#if defined(__linux__)
+  bool update_key_repeat();
+  // when the next forward device kept for reuse is destroyed by flush()
+  std::optional<std::chrono::steady_clock::time_point> next_release_deadline() const;
+  // releases ownership of the virtual devices (event id, fd) without destroying
+  // them, the keyboard has event id -1
+  std::vector<std::pair<int, int>> release_devices();
+#endif
 
 private:
   std::unique_ptr<class VirtualDevicesImpl> m_impl;
 };
 
+#if defined(__linux__)
+// seconds to keep forward devices of disconnected devices for reuse
+extern int linux_forward_device_pool_timeout;
+// path of file to write output events to instead of the virtual devices
+extern std::string linux_output_trace;
+// autorepeat of virtual keyboard (milliseconds, repeats per second), 0 for default
+extern int linux_key_repeat_delay;
+extern int linux_key_repeat_rate;
+// virtual devices created by the previous process (event id, fd), taken over
+extern std::vector<std::pair<int, int>> linux_handoff_virtual_devices;
+#endif
+
 #if defined(__APPLE__)
 #include <atomic>
 extern bool macos_toggle_fn;
@@ -1,6 +1,7 @@
 
 #include "VirtualDevices.h"
 #include "DeviceDescLinux.h"
+#include "HandoffLinux.h"
 #include "runtime/KeyEvent.h"
 #include "common/output.h"
 #include <algorithm>
@@ -10,6 +11,8 @@
 #include <unistd.h>
 #include <chrono>
 #include <map>
+#include <utility>
+#include <tuple>
 
 #if defined(__FreeBSD__)
 # include <dev/evdev/uinput.h>
@@ -17,6 +20,12 @@
 # include <linux/uinput.h>
 #endif
 
+int linux_forward_device_pool_timeout;
+std::string linux_output_trace;
+int linux_key_repeat_delay;
+int linux_key_repeat_rate;
+std::vector<std::pair<int, int>> linux_handoff_virtual_devices;
+
 namespace {
   std::string get_forward_device_name(const std::string& device_name) {
     // ensure appended virtual device name is never truncated
@@ -36,7 +45,22 @@ namespace {
     return -1;
   }
 
+  int open_output_trace() {
+    // write input_event records like to a uinput device
+    verbose("Writing output events to '%s'", linux_output_trace.c_str());
+    do {
+      const auto fd = ::open(linux_output_trace.c_str(),
+        O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd >= 0)
+        return fd;
+    } while (errno == EINTR);
+    return -1;
+  }
+
   int create_keyboard_device() {
+    if (!linux_output_trace.empty())
+      return open_output_trace();
+
     verbose("Creating virtual keyboard device '%s'", VirtualDevices::name);
     const auto fd = open_uinput_device();
     if (fd < 0)
@@ -169,12 +193,27 @@ namespace {
     return static_cast<bool>(desc.rel_axes & (REL_X | REL_Y));
   }
 
+  bool has_same_capabilities(const DeviceDescLinux& a, const DeviceDescLinux& b) {
+    const auto abs_axis_equal = [](const DeviceDescLinux::AbsAxis& a,
+                                   const DeviceDescLinux::AbsAxis& b) {
+      return (std::tie(a.code, a.minimum, a.maximum, a.fuzz, a.flat, a.resolution) ==
+              std::tie(b.code, b.minimum, b.maximum, b.fuzz, b.flat, b.resolution));
+    };
+    return (std::tie(a.vendor_id, a.product_id, a.version_id, a.keys, a.rel_axes,
+                     a.rep_events, a.switch_events, a.misc_events, a.properties) ==
+            std::tie(b.vendor_id, b.product_id, b.version_id, b.keys, b.rel_axes,
+                     b.rep_events, b.switch_events, b.misc_events, b.properties) &&
+            std::equal(a.abs_axes.begin(), a.abs_axes.end(), 
+                       b.abs_axes.begin(), b.abs_axes.end(), abs_axis_equal));
+  }
+
   class VirtualDevice {
   private:
-    const int m_uinput_fd{ -1 };
+    int m_uinput_fd{ -1 };
     const bool m_has_mouse_axes{ false };
     std::vector<Key> m_down_keys;
     int m_highres_wheel_accumulators[2]{ };
+    std::vector<input_event> m_write_buffer;
 
   public:
     explicit VirtualDevice(int uinput_fd)
@@ -187,6 +226,7 @@ namespace {
     }
 
     ~VirtualDevice() {
+      flush();
       destroy_uinput_device(m_uinput_fd);
     }
 
@@ -194,6 +234,24 @@ namespace {
       return m_has_mouse_axes;
     }
 
+    // returns the uinput device without destroying it
+    int release() {
+      flush();
+      return std::exchange(m_uinput_fd, -1);
+    }
+
+    void reset() {
+      if (!m_down_keys.empty()) {
+        for (auto key : m_down_keys)
+          send_event(EV_KEY, *key, 0);
+        send_event(EV_SYN, SYN_REPORT, 0);
+        flush();
+        m_down_keys.clear();
+      }
+      m_highres_wheel_accumulators[0] = 0;
+      m_highres_wheel_accumulators[1] = 0;
+    }
+
     int update_key_state(const KeyEvent& event) {
       const auto release = 0;
       const auto press = 1;
@@ -224,7 +282,7 @@ namespace {
     }
 
     bool send_event(int type, int code, int value) {
-      auto event = input_event{ };
+      auto& event = m_write_buffer.emplace_back();
       auto time = timeval{ };
       ::gettimeofday(&time, nullptr);
       event.input_event_sec = time.tv_sec;
@@ -232,13 +290,26 @@ namespace {
       event.type = static_cast<unsigned short>(type);
       event.code = static_cast<unsigned short>(code);
       event.value = value;
-      do {
-        const auto result = ::write(m_uinput_fd, &event, sizeof(event));
-        if (result >= 0)
-          return (result == sizeof(event));
-      } while (errno == EINTR);
+      return true;
+    }
 
-      return false;
+    // write all buffered events at once
+    bool flush() {
+      auto buffer = reinterpret_cast<const char*>(m_write_buffer.data());
+      auto length = m_write_buffer.size() * sizeof(input_event);
+      while (length != 0) {
+        const auto result = ::write(m_uinput_fd, buffer, length);
+        if (result == -1 && errno == EINTR)
+          continue;
+        if (result <= 0) {
+          m_write_buffer.clear();
+          return false;
+        }
+        length -= static_cast<size_t>(result);
+        buffer += result;
+      }
+      m_write_buffer.clear();
+      return true;
     }
   };
 } // namespace
@@ -247,21 +318,74 @@ namespace {
 
 class VirtualDevicesImpl {
 private:
+  using Clock = std::chrono::steady_clock;
+  using ForwardDevices = std::map<int, VirtualDevice>;
+
+  // forward devices of disconnected devices, which are kept for reuse
+  struct PooledDevice {
+    std::string name;
+    std::shared_ptr<const DeviceDescExt> desc;
+    ForwardDevices::node_type node;
+    Clock::time_point released_at;
+  };
+
   std::unique_ptr<VirtualDevice> m_keyboard;
-  std::map<int, VirtualDevice> m_forward_devices;
+  ForwardDevices m_forward_devices;
+  std::vector<std::pair<std::string, 
+    std::shared_ptr<const DeviceDescExt>>> m_forward_device_descs;
+  std::vector<PooledDevice> m_pooled_devices;
   std::vector<VirtualDevice*> m_devices;
   VirtualDevice* m_last_active_mouse{ };
+  VirtualDevice* m_unflushed_device{ };
+  // defaults of kernel's software autorepeat
+  std::pair<int, int> m_key_repeat{ 250, 33 };
 
 public:
   bool create_keyboard_device() {
-    const auto uinput_fd = ::create_keyboard_device();
-    if (uinput_fd < 0)
-      return false;
+    auto uinput_fd = take_handoff_device(linux_handoff_virtual_devices, -1);
+    if (uinput_fd >= 0) {
+      verbose("Taking over virtual keyboard device '%s'", VirtualDevices::name);
+      // key repeat of previous process is unknown
+      m_key_repeat = { };
+    }
+    else {
+      uinput_fd = ::create_keyboard_device();
+      if (uinput_fd < 0)
+        return false;
+    }
     m_keyboard = std::make_unique<VirtualDevice>(uinput_fd);
-    return true;
+    return update_key_repeat();
+  }
+
+  std::vector<std::pair<int, int>> release_devices() {
+    flush_device();
+    auto devices = std::vector<std::pair<int, int>>();
+    for (auto& [event_id, device] : m_forward_devices) {
+      device.reset();
+      devices.emplace_back(event_id, device.release());
+    }
+    m_keyboard->reset();
+    devices.emplace_back(-1, m_keyboard->release());
+    return devices;
+  }
+
+  bool update_key_repeat() {
+    const auto key_repeat = std::make_pair(
+      (linux_key_repeat_delay > 0 ? linux_key_repeat_delay : 250),
+      (linux_key_repeat_rate > 0 ? 1000 / linux_key_repeat_rate : 33));
+    if (key_repeat == m_key_repeat)
+      return true;
+
+    verbose("Setting key repeat delay %dms, period %dms",
+      key_repeat.first, key_repeat.second);
+    m_key_repeat = key_repeat;
+    send_event(m_keyboard.get(), EV_REP, REP_DELAY, key_repeat.first);
+    send_event(m_keyboard.get(), EV_REP, REP_PERIOD, key_repeat.second);
+    return flush_device();
   }
 
   bool update_forward_devices(const std::vector<DeviceDesc>& device_descs) {
+    flush_device();
     auto prev = std::move(m_forward_devices);
     m_last_active_mouse = nullptr;
     m_forward_devices.clear();
@@ -271,13 +395,23 @@ public:
       auto& device = m_devices.emplace_back(m_keyboard.get());
       
       // create virtual forward device for event id (reuse existing)      
-      if (const auto* desc_ext = static_cast<const DeviceDescLinux*>(desc.ext.get())) {
+      const auto* desc_ext = static_cast<const DeviceDescLinux*>(desc.ext.get());
+      if (desc_ext && linux_output_trace.empty()) {
         if (auto node = prev.extract(desc_ext->event_id)) {
           device = &m_forward_devices.insert(std::move(node)).position->second;
         }
+        else if (auto node = take_pooled_device(desc.name, *desc_ext)) {
+          node.key() = desc_ext->event_id;
+          device = &m_forward_devices.insert(std::move(node)).position->second;
+        }
         else {
-          const auto uinput_fd = ::create_forward_device(
-            get_forward_device_name(desc.name), *desc_ext);
+          auto uinput_fd = take_handoff_device(
+            linux_handoff_virtual_devices, desc_ext->event_id);
+          if (uinput_fd >= 0)
+            verbose("Taking over virtual forward device '%s'", desc.name.c_str());
+          else
+            uinput_fd = ::create_forward_device(
+              get_forward_device_name(desc.name), *desc_ext);
           if (uinput_fd < 0)
              return false;
           device = &m_forward_devices.emplace(std::piecewise_construct,
@@ -286,16 +420,67 @@ public:
         }
       }
     }
+
+    // keep forward devices of disconnected devices for a while
+    const auto now = Clock::now();
+    for (const auto& [name, desc] : m_forward_device_descs) {
+      const auto& desc_ext = static_cast<const DeviceDescLinux&>(*desc);
+      if (auto node = prev.extract(desc_ext.event_id)) {
+        node.mapped().reset();
+        m_pooled_devices.push_back({ name, desc, std::move(node), now });
+      }
+    }
+    m_forward_device_descs.clear();
+    for (const auto& desc : device_descs)
+      if (desc.ext)
+        m_forward_device_descs.emplace_back(desc.name, desc.ext);
+
+    // destroy devices of previous process which are no longer needed
+    for (auto& [event_id, uinput_fd] : linux_handoff_virtual_devices)
+      destroy_uinput_device(uinput_fd);
+    linux_handoff_virtual_devices.clear();
+
+    release_idle_devices();
     return true;
   }
 
+  std::optional<Clock::time_point> next_release_deadline() const {
+    if (m_pooled_devices.empty())
+      return std::nullopt;
+    auto released_at = m_pooled_devices.front().released_at;
+    for (const auto& device : m_pooled_devices)
+      released_at = std::min(released_at, device.released_at);
+    return released_at + std::chrono::seconds(linux_forward_device_pool_timeout);
+  }
+
+  void release_idle_devices() {
+    const auto pool_timeout = std::chrono::seconds(
+      linux_forward_device_pool_timeout);
+    const auto now = Clock::now();
+    m_pooled_devices.erase(std::remove_if(
+      m_pooled_devices.begin(), m_pooled_devices.end(),
+      [&](const PooledDevice& device) {
+        return (now >= device.released_at + pool_timeout);
+      }), m_pooled_devices.end());
+  }
+
   bool forward_event(int device_index, int type, int code, int value) {
     auto device = m_devices[device_index];
 
     if (device->has_mouse_axes())
       m_last_active_mouse = device;
 
-    return device->send_event(type, code, value);
+    if (!send_event(device, type, code, value))
+      return false;
+
+    // send each report with a single write
+    return (type != EV_SYN || flush_device());
+  }
+
+  bool flush() {
+    if (!m_pooled_devices.empty())
+      release_idle_devices();
+    return flush_device();
   }
 
   bool send_key_event(const KeyEvent& event) {
@@ -309,15 +494,48 @@ public:
       const auto vertical = (event.key == Key::WheelUp || event.key == Key::WheelDown);
       const auto negative = (event.key == Key::WheelDown || event.key == Key::WheelLeft);
       const auto value = (event.value ? event.value : 120) * (negative ? -1 : 1);
-      device->send_event(EV_REL, (vertical ? REL_WHEEL_HI_RES : REL_HWHEEL_HI_RES), value);
+      send_event(device, EV_REL, (vertical ? REL_WHEEL_HI_RES : REL_HWHEEL_HI_RES), value);
       if (auto lowres_value = device->update_lowres_wheel(vertical, value))
-        device->send_event(EV_REL, (vertical ? REL_WHEEL : REL_HWHEEL), lowres_value);
+        send_event(device, EV_REL, (vertical ? REL_WHEEL : REL_HWHEEL), lowres_value);
     }
     else {
-      if (!device->send_event(EV_KEY, *event.key, device->update_key_state(event)))
+      if (!send_event(device, EV_KEY, *event.key, device->update_key_state(event)))
         return false;
     }
-    return device->send_event(EV_SYN, SYN_REPORT, 0);
+    return send_event(device, EV_SYN, SYN_REPORT, 0);
+  }
+
+private:
+  bool send_event(VirtualDevice* device, int type, int code, int value) {
+    // keep order of events sent with different devices
+    if (m_unflushed_device != device) {
+      if (!flush_device())
+        return false;
+      m_unflushed_device = device;
+    }
+    return device->send_event(type, code, value);
+  }
+
+  bool flush_device() {
+    if (auto device = std::exchange(m_unflushed_device, nullptr))
+      return device->flush();
+    return true;
+  }
+
+  ForwardDevices::node_type take_pooled_device(
+      const std::string& name, const DeviceDescLinux& desc) {
+    const auto it = std::find_if(m_pooled_devices.begin(), m_pooled_devices.end(),
+      [&](const PooledDevice& device) {
+        return (device.name == name && has_same_capabilities(
+          static_cast<const DeviceDescLinux&>(*device.desc), desc));
+      });
+    if (it == m_pooled_devices.end())
+      return { };
+
+    verbose("Reusing virtual forward device '%s'", name.c_str());
+    auto node = std::move(it->node);
+    m_pooled_devices.erase(it);
+    return node;
   }
 };
 
@@ -350,5 +568,21 @@ bool VirtualDevices::forward_event(int device_index, int type, int code, int val
 }
 
 bool VirtualDevices::flush() {
-  return true;
+  return (m_impl && m_impl->flush());
+}
+
+auto VirtualDevices::next_release_deadline() const 
+    -> std::optional<std::chrono::steady_clock::time_point> {
+  return (m_impl ? m_impl->next_release_deadline() : std::nullopt);
+}
+
+bool VirtualDevices::update_key_repeat() {
+  return (m_impl && m_impl->update_key_repeat());
+}
+
+std::vector<std::pair<int, int>> VirtualDevices::release_devices() {
+  auto devices = (m_impl ? m_impl->release_devices() :
+    std::vector<std::pair<int, int>>());
+  m_impl.reset();
+  return devices;
 }
@@ -3,23 +3,44 @@
 #include "VirtualDevices.h"
 #include "server/Settings.h"
 #include "server/ServerState.h"
+#include "server/LatencyStats.h"
 #include "runtime/Timeout.h"
 #include "common/output.h"
 #include <csignal>
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
 #include <atomic>
+#include <thread>
+#include <utility>
+
+#if defined(__linux__)
+# include "HandoffLinux.h"
+# include "RealtimeLinux.h"
+# include <filesystem>
+# include <string>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/socket.h>
+#endif
 
 namespace {
   class ServerStateImpl final : public ServerState {
   private:
     bool on_send_key(const KeyEvent& event) override;
     void on_exit_requested() override;
-    void on_configuration_message(MultiStagePtr stage) override;
+    bool on_configuration_message(MultiStagePtr stage) override;
     void on_grab_device_filters_message(
       std::vector<GrabDeviceFilter> filters) override;
     void on_directives_message(
       const std::vector<std::string>& directives) override;
+    bool on_flushed_send_buffer() override;
+
+  public:
+    void restore_virtual_keys(const std::vector<Key>& keys);
   };
   
+  Settings g_settings;
   VirtualDevices g_virtual_devices;
   GrabbedDevices g_grabbed_devices;
   int g_interrupt_fd;
@@ -27,22 +48,76 @@ namespace {
   std::vector<GrabDeviceFilter> m_grab_device_filters;
   bool g_grab_device_filters_changed;
   ServerStateImpl g_state;
+
+#if defined(__linux__)
+  struct LatencyMeasurement {
+    LatencyStats read;
+    LatencyStats translate;
+    LatencyStats flush;
+    LatencyStats total;
+  };
+  std::unique_ptr<LatencyMeasurement> g_latency;
+  std::atomic<bool> g_print_latency;
+  std::atomic<bool> g_handoff;
+  bool g_input_trace_failed;
+  std::filesystem::path g_executable_path;
+  std::vector<std::string> g_arguments;
+  std::vector<Key> g_handoff_virtual_keys;
+  Socket g_listen_socket = invalid_socket;
+
+  // devices handed off by the previous process are released,
+  // when keymapper did not send a configuration in time
+  const auto handoff_timeout = std::chrono::seconds(5);
+  std::optional<Clock::time_point> g_handoff_deadline;
+
+  void handle_print_latency_signal(int) {
+    g_print_latency.store(true);
+  }
+
+  void print_latency() {
+    if (!g_latency || !g_latency->total.count())
+      return;
+    message("Latency of keymapperd (from kernel event time to output):");
+    g_latency->read.print("read");
+    g_latency->translate.print("translate");
+    g_latency->flush.print("flush");
+    g_latency->total.print("total");
+  }
+
+  void print_statistics() {
+    const auto statistics = g_grabbed_devices.statistics();
+    if (statistics.events_dropped)
+      message("Input events were dropped %d times, %d key events were resynchronized",
+        statistics.events_dropped, statistics.keys_resynced);
+    print_latency();
+  }
+#endif
   
   bool ServerStateImpl::on_send_key(const KeyEvent& event) {
     return g_virtual_devices.send_key_event(event);
   }
 
+  bool ServerStateImpl::on_flushed_send_buffer() {
+    return g_virtual_devices.flush();
+  }
+
+  void ServerStateImpl::restore_virtual_keys(const std::vector<Key>& keys) {
+    for (auto key : keys)
+      set_virtual_key_state(key, KeyState::Down);
+    flush_send_buffer();
+  }
+
   void ServerStateImpl::on_exit_requested() {
     g_shutdown.store(true);
   }
 
-  void ServerStateImpl::on_configuration_message(MultiStagePtr stage) {
-    if (has_configuration() &&
+  bool ServerStateImpl::on_configuration_message(MultiStagePtr stage) {
+    if (stage && has_configuration() &&
         has_mouse_mappings() != stage->has_mouse_mappings()) {
       verbose("Mouse usage in configuration changed");
       g_grab_device_filters_changed = true;
     }
-    ServerState::on_configuration_message(std::move(stage));
+    return ServerState::on_configuration_message(std::move(stage));
   }
     
   void ServerStateImpl::on_grab_device_filters_message(
@@ -71,6 +146,14 @@ namespace {
 
 #if defined(__linux__)
     linux_highres_wheel_events = is_enabled("linux-highres-wheel-events");
+
+    linux_key_repeat_delay = 0;
+    linux_key_repeat_rate = 0;
+    for (const auto& directive : directives)
+      std::sscanf(directive.c_str(), "linux-key-repeat %d %d",
+        &linux_key_repeat_delay, &linux_key_repeat_rate);
+    linux_suppress_key_repeat = (linux_key_repeat_rate > 0);
+    g_virtual_devices.update_key_repeat();
 #endif
 
 #if defined(__APPLE__)
@@ -81,9 +164,30 @@ namespace {
     ServerState::on_directives_message(directives);
   }
 
+#if defined(__linux__)
+  void enable_realtime_mode() {
+    static auto s_enabled = false;
+    if (!g_settings.realtime || std::exchange(s_enabled, true))
+      return;
+
+    set_realtime_scheduling(g_settings.realtime_round_robin,
+      g_settings.realtime_priority, g_settings.realtime_cpu);
+    lock_memory();
+  }
+#endif
+
+  std::optional<Duration> get_handoff_timeout() {
+#if defined(__linux__)
+    if (g_handoff_deadline)
+      return std::max(Duration::zero(),
+        Duration(*g_handoff_deadline - Clock::now()));
+#endif
+    return std::nullopt;
+  }
+
   bool read_initial_config() {
     while (!g_state.has_configuration()) {
-      if (!g_state.read_client_messages()) {
+      if (!g_state.read_client_messages(get_handoff_timeout())) {
         error("Receiving configuration failed");
         return false;
       }
@@ -91,41 +195,77 @@ namespace {
     return true;
   }
 
+  bool is_output_delayed(const ServerState& s) {
+    return (s.flush_scheduled_at() || s.timeout_start_at());
+  }
+
   bool main_loop() {
     auto& s = g_state;
     for (;;) {
       // wait for next input event
+      // wake up at the earliest pending deadline
       auto now = Clock::now();
       auto timeout = std::optional<Duration>();
-      const auto set_timeout = [&](const Duration& duration) {
-        if (!timeout || duration < timeout)
-          timeout = duration;
-      };
-      
-      if (s.flush_scheduled_at())
-        set_timeout(s.flush_scheduled_at().value() - now);
-      if (s.timeout_start_at())
-        set_timeout(s.timeout_start_at().value() + s.timeout() - now);
+      if (const auto deadline = s.next_deadline())
+        timeout = deadline.value() - now;
+#if defined(__linux__)
+      // also to destroy forward devices which were not reused
+      if (const auto deadline = g_virtual_devices.next_release_deadline())
+        if (!timeout || deadline.value() - now < timeout.value())
+          timeout = std::max(Duration(deadline.value() - now), Duration::zero());
+#endif
 
       if (g_shutdown.load()) {
         verbose("Received shutdown signal");
         return false;
       }
 
+#if defined(__linux__)
+      if (g_handoff.load()) {
+        verbose("Received handoff signal");
+        return false;
+      }
+#endif
+
+#if defined(__linux__)
+      // wheel events can only be merged when they are not mapped
+      linux_coalesce_wheel_events = !s.has_wheel_mappings();
+#endif
+
       // interrupt waiting when client sends an update
       const auto [succeeded, input] =
         g_grabbed_devices.read_input_event(timeout, g_interrupt_fd);
+#if defined(__linux__)
+      if (!succeeded && !linux_input_trace.empty()) {
+        if (!g_grabbed_devices.end_of_input_trace()) {
+          error("Reading input trace failed");
+          g_input_trace_failed = true;
+          return false;
+        }
+        // let delayed output and timeouts be processed before exiting
+        if (!s.next_deadline()) {
+          verbose("Reached end of input trace");
+          return false;
+        }
+        std::this_thread::sleep_for(timeout.value_or(Duration::zero()));
+      }
+      else
+#endif
       if (!succeeded) {
         error("Reading input event failed");
         return true;
       }
 
       now = Clock::now();
+      auto translated_at = std::optional<Clock::time_point>();
+      [[maybe_unused]] auto delayed = is_output_delayed(s);
 
       if (input) {
         if (auto event = to_key_event(input.value())) {
-          if (event->key != Key::none)
-            s.translate_input(event.value(), input->device_index);
+          if (event->key != Key::none) {
+            s.translate_input(event.value(), input->device_index, input->time);
+            translated_at = Clock::now();
+          }
         }
         else {
           // forward other events
@@ -142,12 +282,31 @@ namespace {
         s.translate_input(timeout, Stage::any_device_index);
       }
 
-      if (!s.flush_scheduled_at() || now > s.flush_scheduled_at()) {
+      if (!s.flush_scheduled_at() || now >= s.flush_scheduled_at()) {
         if (!s.flush_send_buffer()) {
           error("Sending input failed");
           return true;
         }
       }
+      g_virtual_devices.flush();
+
+      // retry sending messages, which the client did not accept yet
+      s.flush_client_messages();
+
+#if defined(__linux__)
+      // do not measure output which is delayed by timeouts or flush delays
+      delayed |= is_output_delayed(s);
+      if (g_latency && translated_at && !delayed) {
+        const auto flushed_at = Clock::now();
+        const auto event_at = input->time.value_or(now);
+        g_latency->read.add(now - event_at);
+        g_latency->translate.add(translated_at.value() - now);
+        g_latency->flush.add(flushed_at - translated_at.value());
+        g_latency->total.add(flushed_at - event_at);
+      }
+      if (g_print_latency.exchange(false))
+        print_statistics();
+#endif
 
       if (g_grabbed_devices.update_devices()) {
         if (!g_virtual_devices.update_forward_devices(
@@ -176,10 +335,103 @@ namespace {
     g_shutdown.store(true);
     g_state.disconnect();
   }
+
+#if defined(__linux__)
+  void handle_handoff_signal(int) {
+    g_handoff.store(true);
+  }
+
+  void receive_handoff(int socket_fd) {
+    auto state = HandoffState{ };
+    if (receive_handoff_state(socket_fd, state)) {
+      verbose("Took over %d grabbed and %d virtual devices",
+        static_cast<int>(state.grabbed_devices.size()),
+        static_cast<int>(state.virtual_devices.size()));
+      linux_handoff_grabbed_devices = std::move(state.grabbed_devices);
+      linux_handoff_virtual_devices = std::move(state.virtual_devices);
+      g_handoff_virtual_keys = std::move(state.virtual_keys_down);
+      g_handoff_deadline = Clock::now() + handoff_timeout;
+    }
+    else {
+      error("Receiving handoff state failed");
+      close_handoff_devices(state.grabbed_devices);
+      close_handoff_devices(state.virtual_devices);
+    }
+    ::close(socket_fd);
+  }
+
+  void release_handoff_devices() {
+    if (!g_handoff_deadline)
+      return;
+    verbose("Releasing handed off devices");
+    close_handoff_devices(linux_handoff_grabbed_devices);
+    close_handoff_devices(linux_handoff_virtual_devices);
+    g_handoff_virtual_keys.clear();
+    g_handoff_deadline.reset();
+  }
+
+  // re-executes the (updated) binary, passing it the grabbed devices,
+  // virtual devices and virtual key state. Only returns on failure.
+  void handoff() {
+    verbose("Handing off devices to '%s'", g_executable_path.c_str());
+    auto state = HandoffState{ };
+    state.virtual_keys_down = g_state.virtual_keys_down();
+    g_state.reset_configuration();
+    g_state.disconnect();
+    state.grabbed_devices = g_grabbed_devices.release_devices();
+    state.virtual_devices = g_virtual_devices.release_devices();
+
+    int sockets[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0) {
+      error("Creating handoff socket failed");
+      close_handoff_devices(state.grabbed_devices);
+      close_handoff_devices(state.virtual_devices);
+      return;
+    }
+    const auto sent = send_handoff_state(sockets[0], state);
+    close_handoff_devices(state.grabbed_devices);
+    close_handoff_devices(state.virtual_devices);
+    ::close(sockets[0]);
+    if (!sent) {
+      error("Sending handoff state failed");
+      ::close(sockets[1]);
+      return;
+    }
+
+    // only pass the handoff socket to the new process
+    auto ec = std::error_code{ };
+    for (const auto& entry : std::filesystem::directory_iterator("/proc/self/fd", ec)) {
+      const auto fd = std::atoi(entry.path().filename().c_str());
+      if (fd > STDERR_FILENO)
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    ::fcntl(sockets[1], F_SETFD, 0);
+
+    auto arguments = g_arguments;
+    arguments.push_back("--handoff");
+    arguments.push_back(std::to_string(sockets[1]));
+    auto argv = std::vector<char*>();
+    for (auto& argument : arguments)
+      argv.push_back(argument.data());
+    argv.push_back(nullptr);
+    ::execv(g_executable_path.c_str(), argv.data());
+
+    error("Executing '%s' failed", g_executable_path.c_str());
+    ::close(sockets[1]);
+  }
+#endif
  
   int connection_loop() {
     while (!g_shutdown.load()) {
       verbose("Waiting for keymapper to connect");
+#if defined(__linux__)
+      if (g_handoff_deadline &&
+          (Clock::now() >= *g_handoff_deadline ||
+           !block_until_readable(g_listen_socket, get_handoff_timeout()))) {
+        release_handoff_devices();
+        continue;
+      }
+#endif
       const auto client_socket = g_state.accept_client_connection();
 
       if (g_state.version_mismatch()) {
@@ -192,6 +444,9 @@ namespace {
       g_interrupt_fd = *client_socket;
 
       if (read_initial_config()) {
+#if defined(__linux__)
+        enable_realtime_mode();
+#endif
         if (!g_grabbed_devices.grab(g_state.has_mouse_mappings(),
               m_grab_device_filters)) {
           error("Initializing input device grabbing failed");
@@ -207,17 +462,34 @@ namespace {
           return 1;
         }
         g_state.set_device_descs(g_grabbed_devices.grabbed_device_descs());
+#if defined(__linux__)
+        g_state.restore_virtual_keys(std::exchange(g_handoff_virtual_keys, { }));
+        g_handoff_deadline.reset();
+#endif
 
         const auto prev_sigint_handler = ::signal(SIGINT, handle_shutdown_signal);
         const auto prev_sigterm_handler = ::signal(SIGTERM, handle_shutdown_signal);
+#if defined(__linux__)
+        // handing off devices is not supported when using traces
+        const auto prev_sighup_handler = ::signal(SIGHUP,
+          (linux_input_trace.empty() && linux_output_trace.empty() ?
+            handle_handoff_signal : SIG_DFL));
+#endif
 
         verbose("Entering update loop");
         if (!main_loop())
           g_shutdown.store(true);
+#if defined(__linux__)
+        if (g_handoff.load())
+          handoff();
+#endif
         g_state.reset_configuration();
 
         ::signal(SIGINT, prev_sigint_handler);
         ::signal(SIGTERM, prev_sigterm_handler);
+#if defined(__linux__)
+        ::signal(SIGHUP, prev_sighup_handler);
+#endif
       }
       g_grabbed_devices = { };
       g_virtual_devices = { };
@@ -229,13 +501,34 @@ namespace {
 } // namespace
 
 int main(int argc, char* argv[]) {
-  auto settings = Settings{ };
+  auto& settings = g_settings;
 
   if (!interpret_commandline(settings, argc, argv)) {
     print_help_message();
     return 1;
   }
   g_verbose_output = settings.verbose;
+#if defined(__linux__)
+  linux_forward_device_pool_timeout = settings.forward_device_timeout;
+  linux_input_trace = settings.input_trace;
+  linux_output_trace = settings.output_trace;
+  if (settings.measure_latency) {
+    g_latency = std::make_unique<LatencyMeasurement>();
+    ::signal(SIGUSR1, handle_print_latency_signal);
+  }
+
+  // remember executable and arguments for re-executing on SIGHUP
+  auto ec = std::error_code{ };
+  g_executable_path = std::filesystem::read_symlink("/proc/self/exe", ec);
+  for (auto i = 0; i < argc; ++i) {
+    if (argv[i] == std::string_view("--handoff") && i + 1 < argc)
+      ++i;
+    else
+      g_arguments.push_back(argv[i]);
+  }
+  if (settings.handoff_fd >= 0)
+    receive_handoff(settings.handoff_fd);
+#endif
 
 #if defined(__APPLE__)
   // when running as user in the graphical environment try to grab input device and exit.
@@ -244,8 +537,18 @@ int main(int argc, char* argv[]) {
     return (g_grabbed_devices.grab(false, { }) ? 0 : 1);
 #endif
 
-  if (!g_state.listen_for_client_connections())
+  const auto listen_socket = g_state.listen_for_client_connections();
+  if (!listen_socket)
     return 1;
+#if defined(__linux__)
+  g_listen_socket = *listen_socket;
+#endif
 
-  return connection_loop();
+  const auto result = connection_loop();
+#if defined(__linux__)
+  print_statistics();
+  if (g_input_trace_failed)
+    return 1;
+#endif
+  return result;
 }
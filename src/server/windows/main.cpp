@@ -19,6 +19,7 @@ namespace {
     void on_flush_scheduled(Duration delay) override;
     void on_timeout_scheduled(Duration timeout) override;
     void on_timeout_cancelled() override;
+    void on_client_messages_retry_scheduled(Duration delay) override;
     void on_exit_requested() override;
     void on_active_contexts_message(
       const std::vector<int>& active_contexts) override;
@@ -30,6 +31,7 @@ namespace {
   
   const auto TIMER_FLUSH_SEND_BUFFER = 1;
   const auto TIMER_TIMEOUT = 2;
+  const auto TIMER_CLIENT_MESSAGES = 3;
   const auto WM_APP_CLIENT_MESSAGE = WM_APP + 0;
   const auto WM_APP_DEVICE_INPUT = WM_APP + 1;
   const auto injected_ident = ULONG_PTR(0xADDED);
@@ -246,6 +248,11 @@ namespace {
     ::KillTimer(g_window, TIMER_TIMEOUT);
   }
 
+  void ServerStateImpl::on_client_messages_retry_scheduled(Duration delay) {
+    ::SetTimer(g_window, TIMER_CLIENT_MESSAGES,
+      to_milliseconds(delay), nullptr);
+  }
+
   void ServerStateImpl::on_exit_requested() {
     ::DestroyWindow(g_window);
   }
@@ -506,6 +513,11 @@ namespace {
           if (!g_state.flush_scheduled_at())
             g_state.flush_send_buffer();
         }
+        else if (wparam == TIMER_CLIENT_MESSAGES) {
+          // retry sending messages, which the client did not accept yet
+          KillTimer(g_window, TIMER_CLIENT_MESSAGES);
+          g_state.flush_client_messages();
+        }
         break;
       }
     }
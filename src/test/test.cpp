@@ -1,5 +1,6 @@
 
 #define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
 #include "catch.hpp"
 
 #include "test.h"
@@ -48,6 +49,7 @@ std::ostream& operator<<(std::ostream& os, const KeyEvent& event) {
     case KeyState::UpMatched: os << '='; break;
     case KeyState::HistoryTiming: os << '='; break;
     case KeyState::OutputOnRelease: os << '^'; break;
+    case KeyState::OutputDelay: os << '+'; break;
     case KeyState::NoMightMatch: os << '?'; break;
     case KeyState::NotTimeout_cancel_on_up_down: os << '?'; break;
   }
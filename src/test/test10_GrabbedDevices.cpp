@@ -0,0 +1,182 @@
+
+#include "test.h"
+
+#if defined(__linux__)
+
+#include "server/unix/GrabbedDevices.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <linux/input.h>
+#include <unistd.h>
+
+namespace {
+  using Event = GrabbedDevices::Event;
+
+  // replays the events as an input trace, like they were read from a device
+  class TraceReplay {
+  public:
+    // garbage can be appended to the events
+    explicit TraceReplay(const std::vector<input_event>& events,
+        size_t garbage_size = 0) {
+      char path[] = "/tmp/keymapper-trace-XXXXXX";
+      const auto fd = ::mkstemp(path);
+      REQUIRE(fd >= 0);
+      auto data = std::vector<char>(events.size() * sizeof(input_event) + garbage_size);
+      std::memcpy(data.data(), events.data(), events.size() * sizeof(input_event));
+      const auto size = static_cast<ssize_t>(data.size());
+      REQUIRE(::write(fd, data.data(), data.size()) == size);
+      ::close(fd);
+      m_path = path;
+      linux_input_trace = m_path;
+    }
+
+    ~TraceReplay() {
+      linux_input_trace.clear();
+      std::remove(m_path.c_str());
+    }
+
+    std::vector<Event> read_events() {
+      REQUIRE(m_devices.grab(false, { }));
+      auto events = std::vector<Event>();
+      for (;;) {
+        const auto [succeeded, event] =
+          m_devices.read_input_event(GrabbedDevices::Duration::zero(), -1);
+        if (!succeeded)
+          break;
+        if (event && event->type != EV_SYN)
+          events.push_back(*event);
+      }
+      return events;
+    }
+
+    const GrabbedDevices& devices() const { return m_devices; }
+
+  private:
+    std::string m_path;
+    GrabbedDevices m_devices;
+  };
+
+  input_event ev(int type, int code, int value) {
+    auto event = input_event{ };
+    event.type = static_cast<unsigned short>(type);
+    event.code = static_cast<unsigned short>(code);
+    event.value = value;
+    return event;
+  }
+
+  input_event key(int code, int value) { return ev(EV_KEY, code, value); }
+  input_event report() { return ev(EV_SYN, SYN_REPORT, 0); }
+  input_event dropped() { return ev(EV_SYN, SYN_DROPPED, 0); }
+  input_event wheel(int value) { return ev(EV_REL, REL_WHEEL, value); }
+  input_event hwheel(int value) { return ev(EV_REL, REL_HWHEEL, value); }
+
+  Event wheel_event(int code, int value) {
+    return Event{ 0, EV_REL, code, value };
+  }
+
+  std::string format(const std::vector<Event>& events) {
+    auto string = std::string();
+    for (const auto& event : events) {
+      if (!string.empty())
+        string += " ";
+      string += std::to_string(event.type) + ":" +
+        std::to_string(event.code) + ":" + std::to_string(event.value);
+    }
+    return string;
+  }
+} // namespace
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Resync key state after dropped events", "[GrabbedDevices]") {
+  auto trace = TraceReplay({
+    key(KEY_A, 1), report(),
+    dropped(),
+    // lost, only contained in the queried key state
+    key(KEY_B, 1), report(),
+    // queued when the key state is queried
+    key(KEY_A, 0), report(),
+  });
+
+  // the release of A is applied only once
+  CHECK(format(trace.read_events()) == format({
+    Event{ 0, EV_KEY, KEY_A, 1 },
+    Event{ 0, EV_KEY, KEY_A, 0 },
+    Event{ 0, EV_KEY, KEY_B, 1 },
+  }));
+  CHECK(trace.devices().statistics().events_dropped == 1);
+  CHECK(trace.devices().statistics().keys_resynced == 2);
+  CHECK(trace.devices().end_of_input_trace());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Incomplete input trace", "[GrabbedDevices]") {
+  auto trace = TraceReplay({ key(KEY_A, 1), report(), key(KEY_A, 0) }, 5);
+
+  // events before the incomplete one are replayed, then it fails
+  CHECK(format(trace.read_events()) == format({
+    Event{ 0, EV_KEY, KEY_A, 1 },
+    Event{ 0, EV_KEY, KEY_A, 0 },
+  }));
+  CHECK(!trace.devices().end_of_input_trace());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Coalesce wheel events", "[GrabbedDevices]") {
+  const auto events = std::vector<input_event>{
+    wheel(1), report(),
+    wheel(1), report(),
+    wheel(2), report(),
+    // other event flushes the merged ones
+    key(KEY_A, 1), report(),
+    wheel(1), report(),
+    // direction changed
+    wheel(-1), report(),
+    wheel(-1), report(),
+    hwheel(1), report(),
+    hwheel(1), report(),
+    wheel(1), report(),
+  };
+
+  linux_coalesce_wheel_events = true;
+  auto coalesced = TraceReplay(events).read_events();
+  linux_coalesce_wheel_events = false;
+  CHECK(format(coalesced) == format({
+    wheel_event(REL_WHEEL_HI_RES, 480),
+    Event{ 0, EV_KEY, KEY_A, 1 },
+    wheel_event(REL_WHEEL_HI_RES, 120),
+    wheel_event(REL_WHEEL_HI_RES, -240),
+    wheel_event(REL_HWHEEL_HI_RES, 240),
+    wheel_event(REL_WHEEL_HI_RES, 120),
+  }));
+
+  // each event is replayed without coalescing
+  CHECK(TraceReplay(events).read_events().size() == 10);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Coalesce wheel events up to maximum value", "[GrabbedDevices]") {
+  // 3 * 1200 still fits in the value of a KeyEvent
+  auto events = std::vector<input_event>();
+  for (auto i = 0; i < 5; ++i) {
+    events.push_back(wheel(10));
+    events.push_back(report());
+  }
+
+  linux_coalesce_wheel_events = true;
+  auto coalesced = TraceReplay(events).read_events();
+  linux_coalesce_wheel_events = false;
+  CHECK(format(coalesced) == format({
+    wheel_event(REL_WHEEL_HI_RES, 3 * 1200),
+    wheel_event(REL_WHEEL_HI_RES, 2 * 1200),
+  }));
+}
+
+//--------------------------------------------------------------------
+
+#endif // __linux__
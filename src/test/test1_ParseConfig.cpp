@@ -1546,6 +1546,35 @@ TEST_CASE("Device directives", "[ParseConfig]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("Key repeat directive", "[ParseConfig]") {
+  auto config = parse_config("@linux-key-repeat 300 25");
+  REQUIRE(config.server_directives.size() == 1);
+  CHECK(config.server_directives[0] == "linux-key-repeat 300 25");
+
+  config = parse_config("@linux-key-repeat");
+  REQUIRE(config.server_directives.size() == 1);
+  CHECK(config.server_directives[0] == "linux-key-repeat 250 30");
+
+  config = parse_config("@linux-key-repeat 500");
+  REQUIRE(config.server_directives.size() == 1);
+  CHECK(config.server_directives[0] == "linux-key-repeat 500 30");
+
+  config = parse_config(R"(
+    [system = "Linux"]
+    [system = "Windows"]
+    @linux-key-repeat 300 25
+  )");
+  CHECK(config.server_directives.empty());
+
+  // Problems
+  CHECK_THROWS(parse_config("@linux-key-repeat 0 30"));
+  CHECK_THROWS(parse_config("@linux-key-repeat 250 0"));
+  CHECK_THROWS(parse_config("@linux-key-repeat 250ms 30"));
+  CHECK_THROWS(parse_config("@linux-key-repeat 250 30 1"));
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("Line break", "[ParseConfig]") {
   auto string = R"(
     A >> \
@@ -1,4 +1,6 @@
 
+// for BENCHMARK, which is only declared when enabled before including Catch
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
 #include "test.h"
 #include "runtime/Timeout.h"
 #include "server/ServerState.h"
@@ -20,6 +22,8 @@ namespace {
     bool send_triggered_action(int action) override { m_triggered_actions.push_back(action); return true; }
     bool send_virtual_key_state(Key key, KeyState state) override { return true; }
     bool send_next_key_info(const std::vector<Key>& keys, const DeviceDesc& device_desc) override { return true; }
+    bool flush_messages() override { return true; }
+    bool has_queued_messages() const override { return false; }
 
     bool read_messages(MessageHandler& handler, 
         std::optional<Duration> timeout) override {
@@ -97,8 +101,8 @@ namespace {
       return result;
     }
 
-    std::string flush() {
-      flush_send_buffer();
+    std::string flush(std::optional<Clock::time_point> time = { }) {
+      flush_send_buffer(time);
 
       auto result = format_sequence(m_output);
       m_output.clear();
@@ -110,6 +114,14 @@ namespace {
       return apply_input(parse_sequence(input), device_index);
     }
 
+    template<size_t N>
+    std::string apply_input_at(const char(&input)[N], Clock::time_point time) {
+      for (auto event : parse_sequence(input))
+        if (!translate_input(event, 0, time))
+          m_output.push_back(event);
+      return flush();
+    }
+
     std::string apply_timeout(Duration timeout) {
       auto event = make_input_timeout_event(timeout);
       cancel_timeout();
@@ -282,6 +294,110 @@ TEST_CASE("Trigger Not Timeout", "[Server]") {
 
 //--------------------------------------------------------------------
 
+TEST_CASE("Timeout measured with event time", "[Server]") {
+  auto state = create_state(R"(
+    ShiftLeft{!200ms} >> B
+    Shift >> Shift
+  )");
+  using namespace std::chrono_literals;
+  const auto now = Clock::now();
+
+  // released within timeout according to event time
+  CHECK(state.apply_input_at("+ShiftLeft", now - 1s) == "");
+  CHECK(state.apply_input_at("-ShiftLeft", now - 900ms) == "+B -B");
+  REQUIRE(state.stage_is_clear());
+
+  // released after timeout according to event time
+  CHECK(state.apply_input_at("+ShiftLeft", now - 500ms) == "");
+  CHECK(state.apply_input_at("-ShiftLeft", now) == "+ShiftLeft -ShiftLeft");
+  REQUIRE(state.stage_is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Pending flush and timeout", "[Server]") {
+  using namespace std::chrono_literals;
+  auto state = create_state(R"(
+    C{200ms} >> D
+  )");
+
+  CHECK(!state.next_deadline());
+  CHECK(state.apply_input("+C") == "");
+  REQUIRE(state.timeout_start_at());
+  const auto timeout_at = state.timeout_start_at().value() +
+    std::chrono::duration_cast<Clock::duration>(state.timeout());
+  CHECK(state.next_deadline() == timeout_at);
+
+  // both are pending, the earliest deadline is reported
+  state.schedule_flush(500ms);
+  REQUIRE(state.flush_scheduled_at());
+  const auto flush_at = state.flush_scheduled_at().value();
+  CHECK(state.timeout_start_at());
+  CHECK(state.next_deadline() == timeout_at);
+
+  CHECK(state.apply_timeout_reached() == "");
+  CHECK(!state.timeout_start_at());
+  CHECK(state.next_deadline() == flush_at);
+
+  CHECK(state.flush() == "+D");
+  CHECK(!state.next_deadline());
+  CHECK(state.apply_input("-C") == "-D");
+  REQUIRE(state.stage_is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Output delays", "[Server]") {
+  auto state = create_state(R"(
+    A >> X 100ms Y
+    B{100ms} >> Z
+  )");
+
+  // output delay is not mistaken for an input timeout
+  CHECK(state.apply_input("+A") == "+X -X");
+  CHECK(!state.timeout_start_at());
+  CHECK(state.flush_scheduled_at());
+  CHECK(state.flush() == "+Y -Y");
+  CHECK(state.apply_input("-A") == "");
+
+  CHECK(state.apply_input("+B") == "");
+  CHECK(state.timeout_start_at());
+  CHECK(!state.flush_scheduled_at());
+  CHECK(state.apply_timeout_reached() == "+Z");
+  CHECK(state.apply_input("-B") == "-Z");
+  REQUIRE(state.stage_is_clear());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Output delay drift", "[Server]") {
+  using namespace std::chrono_literals;
+  auto macro = std::string("A >> ");
+  for (auto i = 0; i < 100; ++i)
+    macro += "X 1ms ";
+  auto state = create_state((macro + "Y").c_str());
+
+  auto output = state.apply_input("+A");
+  REQUIRE(state.flush_scheduled_at());
+  const auto first_flush_at = state.flush_scheduled_at().value();
+
+  // wake up late for each step, like an event loop does
+  auto steps = 0;
+  auto last_flush_at = first_flush_at;
+  while (const auto flush_at = state.flush_scheduled_at()) {
+    // lateness of each wake up does not accumulate
+    CHECK(flush_at.value() == last_flush_at + (steps ? 1ms : 0ms));
+    last_flush_at = flush_at.value();
+    output += " " + state.flush(flush_at.value() + 200us);
+    ++steps;
+  }
+  CHECK(steps == 100);
+  CHECK(last_flush_at == first_flush_at + 99ms);
+  CHECK(output.find("+Y -Y") != std::string::npos);
+}
+
+//--------------------------------------------------------------------
+
 TEST_CASE("ContextActive with fallthrough contexts", "[Server]") {
   auto state = create_state(R"(
     [modifier = B]
@@ -1415,3 +1531,92 @@ TEST_CASE("virtual-keys-toggle directive", "[Server]") {
   CHECK(state2.apply_input("+X -X") == "+X -X");
   REQUIRE(state2.stage_is_clear());
 }
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Configuration delta", "[Server]") {
+  auto state = create_state(R"(
+    A >> B
+    [stage]
+    C >> D
+  )");
+  REQUIRE(state.stages().size() == 2);
+
+  // contexts of the current configuration, like they are cached
+  auto current = std::vector<ConfigurationDelta::Context>();
+  for (const auto& stage : state.stages())
+    for (const auto& context : stage->contexts())
+      current.push_back({ !current.empty(), -1, 
+        std::make_shared<const Stage::Context>(context) });
+
+  // unchanged configuration is not applied again
+  CHECK(is_unchanged_configuration({ { { false, 0, { } }, { true, 1, { } } } },
+    current.size()));
+  CHECK(!is_unchanged_configuration({ { { false, 1, { } }, { true, 0, { } } } },
+    current.size()));
+  CHECK(!is_unchanged_configuration({ { { false, 0, { } } } }, current.size()));
+
+  // replace context of second stage
+  auto [changed, directives] = create_multi_stage(R"(
+    [stage]
+    C >> E
+  )");
+  const auto& changed_context = changed->stages().back()->contexts().back();
+  auto contexts = resolve_configuration_delta({ {
+    { false, 0, { } }, 
+    { true, -1, std::make_shared<const Stage::Context>(changed_context) } } }, 
+    current);
+  REQUIRE(contexts.has_value());
+  CHECK(contexts->at(0).current_index == -1);
+  // unchanged context is shared with the current configuration
+  CHECK(contexts->at(0).context == current[0].context);
+  state.set_configuration(make_multi_stage(*contexts), { });
+  CHECK(state.set_active_contexts({ 0, 1 }) == "");
+  REQUIRE(state.stages().size() == 2);
+  CHECK(state.apply_input("+A -A") == "+B -B");
+  CHECK(state.apply_input("+C -C") == "+E -E");
+
+  // remove first context
+  contexts = resolve_configuration_delta({ { { false, 1, { } } } }, *contexts);
+  REQUIRE(contexts.has_value());
+  state.set_configuration(make_multi_stage(*contexts), { });
+  CHECK(state.set_active_contexts({ 0 }) == "");
+  REQUIRE(state.stages().size() == 1);
+  CHECK(!state.stages()[0]->contexts().empty());
+  CHECK(state.apply_input("+A -A") == "+A -A");
+  CHECK(state.apply_input("+C -C") == "+E -E");
+
+  // invalid index is reported, so the complete configuration is requested
+  CHECK(!resolve_configuration_delta({ { { false, 5, { } } } }, *contexts));
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Wheel mappings", "[Server]") {
+  CHECK(!create_state("A >> B").has_wheel_mappings());
+  CHECK(!create_state("A >> WheelUp").has_wheel_mappings());
+  CHECK(create_state("WheelUp >> B").has_wheel_mappings());
+  CHECK(create_state("A{WheelDown} >> B").has_wheel_mappings());
+  CHECK(create_state("[modifier = WheelLeft]\n A >> B").has_wheel_mappings());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Fast scrolling benchmark", "[.benchmark]") {
+  auto state = create_state(R"(
+    A >> B
+    Shift{C} >> D
+  )");
+
+  // 32 highres events of a free-spinning wheel, separately and merged
+  auto single = KeySequence();
+  single.resize(32, KeyEvent(Key::WheelDown, KeyState::Up, 120));
+  const auto coalesced = KeySequence{ KeyEvent(Key::WheelDown, KeyState::Up, 32 * 120) };
+
+  BENCHMARK("single wheel events") {
+    return state.apply_input(single);
+  };
+  BENCHMARK("coalesced wheel events") {
+    return state.apply_input(coalesced);
+  };
+}
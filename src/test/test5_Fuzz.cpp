@@ -83,3 +83,69 @@ TEST_CASE("Fuzz NoMightMatch", "[Fuzz]") {
     REQUIRE(stage.history_size() < 8 * 2);
   }
 }
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Fuzz bypassing unmapped keys", "[Fuzz]") {
+  auto config = R"(
+    Ext = IntlBackslash
+    Ext{W{K}}      >> 1
+    ShiftLeft{L}   >> !ShiftLeft 2
+    ControlLeft{J} >> 3 ^ 4
+    Ext{H}         >> X Virtual1
+    Virtual1{U}    >> !ShiftLeft Y
+    A !200ms       >> Z
+    B{200ms}       >> C
+    G              >> ShiftLeft{O}
+
+    [modifier = "AltLeft"]
+    I              >> ShiftLeft{O}
+  )";
+  Stage stage = create_stage(config);
+  Stage reference = create_stage(config);
+  reference.set_bypass_unmapped_keys(false);
+
+  // mapped, only output and unmapped keys
+  auto keys = std::vector<Key>();
+  for (auto k : { "IntlBackslash", "W", "K", "ShiftLeft", "L", "ControlLeft",
+                  "J", "H", "U", "A", "B", "G", "I", "AltLeft",
+                  "X", "Y", "Z", "C", "O", "Q", "R", "ShiftRight", "ButtonLeft" })
+    keys.push_back(parse_input(k).front().key);
+  auto pressed = std::set<Key>();
+
+  const auto apply = [&](KeyEvent event, int device_index) {
+    const auto output = stage.update(event, device_index);
+    const auto expected = reference.update(event, device_index);
+    REQUIRE(format_sequence(output) == format_sequence(expected));
+    REQUIRE(format_sequence(stage.sequence()) == format_sequence(reference.sequence()));
+    REQUIRE(stage.get_output_keys_down() == reference.get_output_keys_down());
+    REQUIRE(stage.is_clear() == reference.is_clear());
+  };
+
+  auto rand = std::mt19937(0);
+  auto dist = std::uniform_int_distribution<size_t>(0, keys.size() - 1);
+  auto action_dist = std::uniform_int_distribution<int>(0, 9);
+  for (auto i = 0; i < 10000; i++) {
+    const auto device_index = action_dist(rand) / 5;
+    const auto action = action_dist(rand);
+    if (action == 0) {
+      apply(reply_timeout_ms(100 + 50 * action_dist(rand)), device_index);
+      continue;
+    }
+
+    const auto key = keys[dist(rand)];
+    if (auto it = pressed.find(key); it != end(pressed)) {
+      // key repeat
+      if (action < 4) {
+        apply({ key, KeyState::Down }, device_index);
+        continue;
+      }
+      pressed.erase(it);
+      apply({ key, KeyState::Up }, device_index);
+    }
+    else {
+      pressed.insert(key);
+      apply({ key, KeyState::Down }, device_index);
+    }
+  }
+}
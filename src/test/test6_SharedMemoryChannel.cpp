@@ -0,0 +1,218 @@
+
+#include "test.h"
+#include "common/SharedMemoryChannel.h"
+#include "common/VirtualKeyStatePage.h"
+#include "common/Connection.h"
+
+#if defined(__linux__)
+
+#include <numeric>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+  struct ChannelPair {
+    int memory_fd{ SharedMemoryChannel::create_memory() };
+    SharedMemoryChannel client;
+    SharedMemoryChannel server;
+
+    ChannelPair() {
+      REQUIRE(memory_fd >= 0);
+      REQUIRE(client.map(memory_fd, true));
+      REQUIRE(server.map(memory_fd, false));
+    }
+    ~ChannelPair() {
+      ::close(memory_fd);
+    }
+  };
+
+  size_t write(SharedMemoryChannel& channel, const std::vector<char>& data,
+      bool* wake_reader = nullptr) {
+    auto buffer = data.data();
+    auto size = data.size();
+    auto wake = false;
+    REQUIRE(channel.write(buffer, size, wake));
+    if (wake_reader)
+      *wake_reader = wake;
+    return data.size() - size;
+  }
+
+  std::vector<char> make_data(size_t size, char first = 0) {
+    auto data = std::vector<char>(size);
+    std::iota(data.begin(), data.end(), first);
+    return data;
+  }
+} // namespace
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Shared memory channel", "[SharedMemoryChannel]") {
+  auto channel = ChannelPair();
+  auto buffer = std::vector<char>();
+
+  // both directions are independent
+  const auto request = make_data(100);
+  const auto reply = make_data(50, 7);
+  auto wake_reader = false;
+  CHECK(write(channel.client, request, &wake_reader) == request.size());
+  CHECK(wake_reader);
+  CHECK(write(channel.server, reply) == reply.size());
+  CHECK(channel.server.has_data());
+  CHECK(channel.client.has_data());
+
+  REQUIRE(channel.server.read(buffer));
+  CHECK(buffer == request);
+  CHECK(!channel.server.has_data());
+  buffer.clear();
+  REQUIRE(channel.client.read(buffer));
+  CHECK(buffer == reply);
+
+  // reader is only woken when ring was empty
+  CHECK(write(channel.client, request, &wake_reader) == request.size());
+  CHECK(wake_reader);
+  CHECK(write(channel.client, request, &wake_reader) == request.size());
+  CHECK(!wake_reader);
+  buffer.clear();
+  REQUIRE(channel.server.read(buffer));
+  CHECK(buffer.size() == 2 * request.size());
+
+  // nothing to read
+  buffer.clear();
+  REQUIRE(channel.server.read(buffer));
+  CHECK(buffer.empty());
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Shared memory channel wrap around", "[SharedMemoryChannel]") {
+  constexpr auto ring_size = size_t{ SharedMemoryChannel::ring_size };
+  auto channel = ChannelPair();
+  auto buffer = std::vector<char>();
+
+  // fill ring, further data does not fit
+  const auto data = make_data(ring_size + 100);
+  CHECK(write(channel.client, data) == ring_size);
+  CHECK(write(channel.client, data) == 0);
+
+  REQUIRE(channel.server.read(buffer));
+  CHECK(buffer.size() == ring_size);
+  CHECK(std::equal(buffer.begin(), buffer.end(), data.begin()));
+
+  // data is split at the end of the ring
+  const auto half = make_data(ring_size / 2 + 10, 3);
+  CHECK(write(channel.client, half) == half.size());
+  CHECK(write(channel.client, half) == ring_size - half.size());
+  buffer.clear();
+  REQUIRE(channel.server.read(buffer));
+  CHECK(buffer.size() == ring_size);
+  CHECK(std::equal(half.begin(), half.end(), buffer.begin()));
+  CHECK(std::equal(buffer.begin() + half.size(), buffer.end(), half.begin()));
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Shared memory channel wait until writable", "[SharedMemoryChannel]") {
+  constexpr auto ring_size = size_t{ SharedMemoryChannel::ring_size };
+  auto channel = ChannelPair();
+
+  // returns immediately when there is space
+  auto start = std::chrono::steady_clock::now();
+  channel.client.wait_until_writable(5000);
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+
+  // writer is woken up by the reader, not by the timeout
+  CHECK(write(channel.client, make_data(ring_size)) == ring_size);
+  auto reader = std::thread([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto buffer = std::vector<char>();
+    CHECK(channel.server.read(buffer));
+  });
+  start = std::chrono::steady_clock::now();
+  channel.client.wait_until_writable(5000);
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+  reader.join();
+  CHECK(write(channel.client, make_data(10)) == 10);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Shared memory channel validation", "[SharedMemoryChannel]") {
+  // memory which could still be resized is not mapped
+  const auto unsealed_fd = ::memfd_create("test", MFD_CLOEXEC);
+  REQUIRE(unsealed_fd >= 0);
+  REQUIRE(::ftruncate(unsealed_fd, 4096) == 0);
+  auto unsealed = SharedMemoryChannel();
+  CHECK(!unsealed.map(unsealed_fd, false));
+  ::close(unsealed_fd);
+
+  // positions which were corrupted by peer are detected
+  auto channel = ChannelPair();
+  const auto memory = ::mmap(nullptr, sizeof(uint32_t),
+    PROT_READ | PROT_WRITE, MAP_SHARED, channel.memory_fd, 0);
+  REQUIRE(memory != MAP_FAILED);
+  *static_cast<uint32_t*>(memory) = SharedMemoryChannel::ring_size + 1;
+
+  auto buffer = std::vector<char>();
+  CHECK(!channel.server.read(buffer));
+  CHECK(buffer.empty());
+  CHECK(write(channel.server, make_data(10)) == 10);
+  ::munmap(memory, sizeof(uint32_t));
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Virtual key state page", "[SharedMemoryChannel]") {
+  using namespace std::chrono_literals;
+  const auto key = get_virtual_key(3);
+  auto writer = VirtualKeyStatePage();
+  REQUIRE(writer.create());
+  REQUIRE(writer.read_only_fd() >= 0);
+
+  // reader cannot map the page writable, not even after reopening it
+  CHECK(::mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED,
+    writer.read_only_fd(), 0) == MAP_FAILED);
+  const auto path = "/proc/self/fd/" + std::to_string(writer.read_only_fd());
+  const auto reopened_fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (reopened_fd >= 0) {
+    CHECK(::mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED,
+      reopened_fd, 0) == MAP_FAILED);
+    CHECK(::write(reopened_fd, "x", 1) == -1);
+    ::close(reopened_fd);
+  }
+
+  auto reader = VirtualKeyStatePage();
+  REQUIRE(reader.map(::fcntl(writer.read_only_fd(), F_DUPFD_CLOEXEC, 0)));
+  CHECK(!reader.is_key_down(key));
+  CHECK(reader.get_change_count(key) == 0);
+
+  writer.set_key_down(key, true);
+  CHECK(reader.is_key_down(key));
+  CHECK(!reader.is_key_down(get_virtual_key(4)));
+  CHECK(reader.get_change_count(key) == 1);
+
+  // setting the same state is no update
+  writer.set_key_down(key, true);
+  CHECK(reader.get_change_count(key) == 1);
+  CHECK(reader.get_change_count(Key::any) == 1);
+
+  // waiting returns when the key changed
+  auto updater = std::thread([&]() {
+    std::this_thread::sleep_for(10ms);
+    writer.release_all_keys();
+  });
+  const auto begin = Clock::now();
+  while (reader.get_change_count(key) == 1 && Clock::now() < begin + 5s)
+    reader.wait_for_change(key, 1, 5s);
+  updater.join();
+  CHECK(!reader.is_key_down(key));
+  CHECK(reader.get_change_count(key) == 2);
+  CHECK(Clock::now() < begin + 1s);
+
+  // waiting times out
+  reader.wait_for_change(key, 2, 1ms);
+  CHECK(reader.get_change_count(key) == 2);
+}
+
+#endif // defined(__linux__)
@@ -0,0 +1,218 @@
+
+// for BENCHMARK, which is only declared when enabled before including Catch
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include "test.h"
+#include "common/Connection.h"
+#include "common/SharedMemoryChannel.h"
+
+#if defined(__linux__)
+
+#include <thread>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+  struct ConnectionPair {
+    Connection a;
+    Connection b;
+
+    explicit ConnectionPair(bool shared_memory = false) {
+      int fds[2];
+      REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+      a = Connection(fds[0]);
+      b = Connection(fds[1]);
+
+      if (shared_memory) {
+        const auto memory_fd = SharedMemoryChannel::create_memory();
+        REQUIRE(memory_fd >= 0);
+        auto channel_a = std::make_unique<SharedMemoryChannel>();
+        auto channel_b = std::make_unique<SharedMemoryChannel>();
+        REQUIRE(channel_a->map(memory_fd, true));
+        REQUIRE(channel_b->map(memory_fd, false));
+        ::close(memory_fd);
+        a.attach_shared_memory(std::move(channel_a));
+        b.attach_shared_memory(std::move(channel_b));
+      }
+    }
+  };
+
+  void send_value(Connection& connection, uint32_t value) {
+    REQUIRE(connection.send_message([&](Serializer& s) { s.write(value); }));
+  }
+
+  std::vector<uint32_t> read_values(Connection& connection,
+      std::optional<Duration> timeout = Duration::zero()) {
+    auto values = std::vector<uint32_t>();
+    REQUIRE(connection.read_messages(timeout, [&](Deserializer& d) {
+      values.push_back(d.read<uint32_t>());
+    }));
+    return values;
+  }
+} // namespace
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Connection messages", "[Connection]") {
+  auto shared_memory = GENERATE(false, true);
+  auto pair = ConnectionPair(shared_memory);
+
+  // queued messages are sent together
+  for (auto i = 1u; i <= 3; ++i)
+    pair.a.queue_message([&](Serializer& s) { s.write(i); });
+  CHECK(read_values(pair.b).empty());
+  REQUIRE(pair.a.flush());
+  CHECK(read_values(pair.b, std::nullopt) == std::vector<uint32_t>{ 1, 2, 3 });
+
+  // replies
+  send_value(pair.b, 4);
+  send_value(pair.b, 5);
+  CHECK(read_values(pair.a, std::nullopt) == std::vector<uint32_t>{ 4, 5 });
+  CHECK(read_values(pair.a).empty());
+
+  // peer closed
+  pair.b.disconnect();
+  CHECK(!pair.a.read_messages(std::nullopt, [](Deserializer&) { }));
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Connection partial messages", "[Connection]") {
+  auto pair = ConnectionPair();
+
+  // message split between reads is kept until it is complete
+  auto value = uint32_t{ 7 };
+  const auto size = uint32_t{ sizeof(value) };
+  char message[sizeof(size) + sizeof(value)];
+  std::memcpy(message, &size, sizeof(size));
+  std::memcpy(message + sizeof(size), &value, sizeof(value));
+
+  send_value(pair.a, 6);
+  REQUIRE(::send(pair.a.socket(), message, 5, 0) == 5);
+  CHECK(read_values(pair.b, std::nullopt) == std::vector<uint32_t>{ 6 });
+  REQUIRE(::send(pair.a.socket(), message + 5, sizeof(message) - 5, 0) ==
+    static_cast<ssize_t>(sizeof(message) - 5));
+  send_value(pair.a, 8);
+  CHECK(read_values(pair.b, std::nullopt) == std::vector<uint32_t>{ 7, 8 });
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Connection file descriptors", "[Connection]") {
+  auto shared_memory = GENERATE(false, true);
+  auto pair = ConnectionPair(shared_memory);
+
+  int fds[2];
+  REQUIRE(::pipe(fds) == 0);
+  pair.a.attach_file_descriptor(fds[1]);
+
+  // attached descriptor is moved along
+  auto moved = std::move(pair.a);
+  pair.a = std::move(moved);
+  send_value(pair.a, 1);
+  ::close(fds[1]);
+  CHECK(pair.a.take_file_descriptor() == -1);
+
+  CHECK(read_values(pair.b, std::nullopt) == std::vector<uint32_t>{ 1 });
+  const auto fd = pair.b.take_file_descriptor();
+  REQUIRE(fd >= 0);
+  CHECK(pair.b.take_file_descriptor() == -1);
+
+  // received descriptor refers to the same pipe
+  REQUIRE(::write(fd, "x", 1) == 1);
+  auto c = char{ };
+  CHECK(::read(fds[0], &c, 1) == 1);
+  CHECK(c == 'x');
+  ::close(fd);
+  ::close(fds[0]);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Connection large messages", "[Connection]") {
+  auto shared_memory = GENERATE(false, true);
+  auto pair = ConnectionPair(shared_memory);
+
+  // larger than socket buffer and ring
+  const auto data = std::vector<uint32_t>(256 * 1024, 0x12345678);
+  auto received = std::vector<uint32_t>();
+  auto reader = std::thread([&]() {
+    while (received.empty())
+      if (!pair.b.read_messages(std::nullopt, [&](Deserializer& d) {
+            received = d.read_vector<uint32_t>();
+          }))
+        break;
+  });
+  CHECK(pair.a.send_message([&](Serializer& s) { s.write(data); }));
+  reader.join();
+  CHECK(received == data);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Connection non-blocking flush", "[Connection]") {
+  auto shared_memory = GENERATE(false, true);
+  auto pair = ConnectionPair(shared_memory);
+
+  // queue more than fits while peer is not reading
+  const auto data = std::vector<uint32_t>(1024, 1);
+  const auto message_count = 1024;
+  for (auto i = 0; i < message_count; ++i)
+    pair.a.queue_message([&](Serializer& s) { s.write(data); });
+  REQUIRE(pair.a.flush(false));
+  CHECK(pair.a.queued_size() > 0);
+
+  // what could not be sent is sent when peer caught up
+  auto received = 0;
+  auto all_equal = true;
+  while (received < message_count) {
+    REQUIRE(pair.a.flush(false));
+    REQUIRE(pair.b.read_messages(Duration::zero(), [&](Deserializer& d) {
+      all_equal &= (d.read_vector<uint32_t>() == data);
+      ++received;
+    }));
+  }
+  CHECK(all_equal);
+  CHECK(pair.a.queued_size() == 0);
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Connection above FD_SETSIZE", "[Connection]") {
+  int fds[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+  auto a = Connection(fds[0]);
+
+  // waiting must not be limited to descriptors select can handle
+  const auto high_fd = ::fcntl(fds[1], F_DUPFD_CLOEXEC, FD_SETSIZE + 1);
+  ::close(fds[1]);
+  if (high_fd < 0)
+    return;
+  auto b = Connection(high_fd);
+
+  CHECK(block_until_readable(high_fd, Duration::zero()));
+  send_value(a, 1);
+  CHECK(read_values(b, std::chrono::seconds(1)) == std::vector<uint32_t>{ 1 });
+  send_value(b, 2);
+  CHECK(read_values(a, std::nullopt) == std::vector<uint32_t>{ 2 });
+}
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Connection round-trip", "[.benchmark]") {
+  const auto round_trip = [](ConnectionPair& pair) {
+    send_value(pair.a, 1);
+    auto values = read_values(pair.b, std::nullopt);
+    send_value(pair.b, values.front() + 1);
+    return read_values(pair.a, std::nullopt).front();
+  };
+
+  auto socket = ConnectionPair(false);
+  BENCHMARK("Socket") { return round_trip(socket); };
+
+  auto shared_memory = ConnectionPair(true);
+  BENCHMARK("Shared memory") { return round_trip(shared_memory); };
+}
+
+#endif // defined(__linux__)
@@ -0,0 +1,35 @@
+
+#include "test.h"
+#include "common/LruCache.h"
+#include <string>
+
+TEST_CASE("LruCache", "[LruCache]") {
+  auto cache = LruCache<int, std::string>(3);
+  CHECK(!cache.front());
+  CHECK(!cache.find(1));
+
+  cache.insert(1, "a");
+  cache.insert(2, "b");
+  cache.insert(3, "c");
+  CHECK(*cache.front() == "c");
+
+  // finding makes value most recently used
+  REQUIRE(cache.find(1));
+  CHECK(*cache.find(1) == "a");
+  CHECK(*cache.front() == "a");
+
+  // least recently used is evicted
+  cache.insert(4, "d");
+  CHECK(cache.size() == 3);
+  CHECK(!cache.find(2));
+  CHECK(*cache.find(3) == "c");
+
+  // inserting again replaces value
+  cache.insert(1, "e");
+  CHECK(cache.size() == 3);
+  CHECK(*cache.front() == "e");
+
+  cache.clear();
+  CHECK(!cache.find(1));
+  CHECK(cache.size() == 0);
+}
@@ -0,0 +1,77 @@
+
+#include "test.h"
+
+#if defined(__linux__)
+
+#include "server/LatencyStats.h"
+#include "server/unix/RealtimeLinux.h"
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include <sched.h>
+
+namespace {
+  // measures how late the calling thread wakes up from sleeping,
+  // like the update loop waiting for the next input event
+  LatencyStats measure_wake_up_latency(std::chrono::milliseconds duration) {
+    const auto interval = std::chrono::microseconds(500);
+    auto stats = LatencyStats();
+    const auto end = Clock::now() + duration;
+    while (Clock::now() < end) {
+      const auto wake_up_at = Clock::now() + interval;
+      std::this_thread::sleep_until(wake_up_at);
+      stats.add(Clock::now() - wake_up_at);
+    }
+    return stats;
+  }
+
+  void print_latency(const char* name, const LatencyStats& stats) {
+    std::printf("%-10s p50 %6lldus  p99 %6lldus  max %6lldus\n", name,
+      static_cast<long long>(stats.percentile(50)),
+      static_cast<long long>(stats.percentile(99)),
+      static_cast<long long>(stats.percentile(100)));
+  }
+} // namespace
+
+//--------------------------------------------------------------------
+
+TEST_CASE("Real-time latency under load", "[.stress]") {
+  using namespace std::chrono_literals;
+
+  // saturate all CPUs
+  auto stop = std::atomic<bool>();
+  auto load = std::vector<std::thread>();
+  const auto threads = std::max(std::thread::hardware_concurrency(), 1u);
+  for (auto i = 0u; i < threads; ++i)
+    load.emplace_back([&]() {
+      while (!stop.load(std::memory_order_relaxed)) { }
+    });
+
+  const auto normal = measure_wake_up_latency(2s);
+  print_latency("normal", normal);
+
+  // scheduling is set for the calling thread only
+  const auto realtime_set = set_realtime_scheduling(false, 50, -1);
+  auto realtime = LatencyStats();
+  if (realtime_set) {
+    realtime = measure_wake_up_latency(2s);
+    print_latency("realtime", realtime);
+
+    auto param = sched_param{ };
+    ::sched_setscheduler(0, SCHED_OTHER, &param);
+  }
+
+  stop.store(true);
+  for (auto& thread : load)
+    thread.join();
+
+  CHECK(normal.count() > 0);
+  if (!realtime_set) {
+    WARN("Real-time scheduling not permitted, only measured without");
+    return;
+  }
+  CHECK(realtime.percentile(99) <= normal.percentile(99));
+}
+
+#endif // defined(__linux__)